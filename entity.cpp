@@ -1,6 +1,9 @@
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstring>
+#include <cstdlib>
+#include <new>
 #include "entity.h"
 #include "stringutils.h"
 
@@ -10,35 +13,85 @@ namespace ASECS
 const int EntityEventInitId = 0;
 const int EntityEventDeinitId = 1;
 
+static std::atomic<uint64_t> EntitySystemSerial(0);
+
+//Merge order key of the commands deferred by the current thread, see
+//EntitySystem::setDeferredCommandIndex and EventWorkerPool::runTasks
+static thread_local uint64_t DeferredCommandKey = 0;
+
+//Keys of commands deferred by [ParallelSafe] handlers, ordered by batch
+//and task after the keys of all the other threads
+static const uint64_t WorkerCommandKeyBase = 1ull << 63;
+
+//Command buffer of the current thread, valid if the serial and key match
+struct ThreadCommandBufferCache
+{
+    uint64_t serial = 0;
+    uint64_t key = 0;
+    DeferredCommandBuffer* buffer = nullptr;
+};
+static thread_local ThreadCommandBufferCache CommandBufferCache;
+
 EntitySystem::EntitySystem(EntitySystemManager *esm, asIScriptEngine *eng)
+    : hasDeferredCommands(false)
 {
     engine = eng;
     manager = esm;
+    serial = ++EntitySystemSerial;
     entitiesToKill.reserve(20000);
     entitiesToSpawn.reserve(20000);
     entitiesToKillSwap.reserve(20000);
     entitiesToSpawnSwap.reserve(20000);
+
+    //slot 0 is reserved for invalid handles
+    entitySlots.resize(1);
 }
 
 EntitySystem::~EntitySystem()
 {
     clear();
+    for (EntitySlab* s : slabs)
+    {
+        if (s)
+            s->orphan();
+    }
+
+    //Iterators still held by scripts free themselves on release
+    while (activeIterators)
+        activeIterators->orphan();
+
+    for (void* p : componentIteratorPool)
+        ::operator delete(p);
+    for (void* p : entityIteratorPool)
+        ::operator delete(p);
+    for (void* p : queryPool)
+        ::operator delete(p);
+    for (void* p : sortedIteratorPool)
+        ::operator delete(p);
 }
 
 void EntitySystem::invalidateIterators()
 {
-    for (auto* i : activeComponentIterators)
-    {
-        i->invalidated = true;
-        i->finished = true;
-    }
-    for (auto* i : activeEntityIterators)
+    ++structureEpoch;
+}
+
+void EntitySystem::touchClasses(const EntityType * type)
+{
+    for (ComponentClass* cls : type->componentTypes)
     {
-        i->invalidated = true;
-        i->finished = true;
+        if (cls->index >= classEpochs.size())
+            classEpochs.resize(cls->index + 1, 0);
+        ++classEpochs[cls->index];
     }
 }
 
+size_t EntitySystem::getClassEpoch(const ComponentClass * cls) const
+{
+    if (cls->index >= classEpochs.size())
+        return 0;
+    return classEpochs[cls->index];
+}
+
 void EntitySystem::clearPreparedEvents()
 {
     for (auto& r : preparedGlobalEvents)
@@ -52,25 +105,136 @@ void EntitySystem::clearPreparedEvents()
         r.second.event->Release();
     }
     preparedLocalEvents.clear();
+    coalescedLocalEvents.clear();
+    coalescedTaggedGlobalEvents.clear();
+    ++globalQueueStamp;
+
+    timers.clear(dueTimers);
+    releaseTimers(dueTimers);
+
+    mergeDeferredCommands(false);
 }
 
-void EntitySystem::prepareGlobalEvent(asIScriptObject * o, int id)
+size_t* EntitySystem::findCoalesced(Entity * e, unsigned int event, size_t position, uint32_t tagMask)
 {
-    if (o == nullptr)
-        return;
+    if (e == nullptr && tagMask != 0)
+    {
+        uint64_t key = ((uint64_t)event << 32) | tagMask;
+        auto res = coalescedTaggedGlobalEvents.insert(std::make_pair(key, position));
+        if (res.second)
+            return nullptr;
+        return &res.first->second;
+    }
+
+    if (e == nullptr)
+    {
+        if (event >= coalescedGlobalEvents.size())
+            coalescedGlobalEvents.resize(event + 1, std::make_pair((size_t) 0, (size_t) 0));
+        auto& slot = coalescedGlobalEvents[event];
+        if (slot.first == globalQueueStamp)
+            return &slot.second;
+        slot.first = globalQueueStamp;
+        slot.second = position;
+        return nullptr;
+    }
 
+    auto res = coalescedLocalEvents.insert(std::make_pair(LocalEventKey{ e, event }, position));
+    if (res.second)
+        return nullptr;
+    return &res.first->second;
+}
 
+//! Check the type of a ?&in event argument, sets a script exception on failure
+static bool CheckEventArgument(int id, const char* error)
+{
     if ((id & asTYPEID_SCRIPTOBJECT) == 0 || (id & asTYPEID_OBJHANDLE) != 0)
     {
         auto* ctx = asGetActiveContext();
         if (ctx)
         {
-            ctx->SetException("ESM::QueueGlobalEvent called with illegal arguments");
+            ctx->SetException(error);
+            return false;
+        }
+    }
+    return true;
+}
+
+void EntitySystem::enqueueGlobalEvent(asIScriptObject * o, unsigned int ev, int mode, uint32_t tagMask)
+{
+    if (mode != EntitySystemManager::CoalesceNone)
+    {
+        size_t* pos = findCoalesced(nullptr, ev, preparedGlobalEvents.size(), tagMask);
+        if (pos)
+        {
+            ++stat_eventsCoalesced;
+            if (mode == EntitySystemManager::CoalesceLast)
+            {
+                auto& queued = preparedGlobalEvents[*pos];
+                o->AddRef();
+                queued.event->Release();
+                queued.event = o;
+            }
+            return;
+        }
+    }
+
+    o->AddRef();
+    preparedGlobalEvents.push_back({ ev, o, tagMask });
+}
+
+void EntitySystem::enqueueLocalEvent(Entity * e, asIScriptObject * o, unsigned int ev, int mode)
+{
+    if (mode != EntitySystemManager::CoalesceNone)
+    {
+        size_t* pos = findCoalesced(e, ev, preparedLocalEvents.size());
+        if (pos)
+        {
+            ++stat_eventsCoalesced;
+            if (mode == EntitySystemManager::CoalesceLast)
+            {
+                auto& queued = preparedLocalEvents[*pos].second.event;
+                o->AddRef();
+                queued->Release();
+                queued = o;
+            }
             return;
         }
     }
+
+    e->addRef();
     o->AddRef();
-    preparedGlobalEvents.push_back({ (unsigned int) id & asTYPEID_MASK_SEQNBR, o });
+    preparedLocalEvents.push_back({ e, { ev, o, 0 } });
+}
+
+void EntitySystem::prepareGlobalEvent(asIScriptObject * o, int id)
+{
+    if (o == nullptr)
+        return;
+
+    if (!CheckEventArgument(id, "ESM::QueueGlobalEvent called with illegal arguments"))
+        return;
+
+    //nobody could handle the event
+    int ev = manager->getEventIndex(id & asTYPEID_MASK_SEQNBR);
+    if (ev < 0)
+        return;
+
+    enqueueGlobalEvent(o, ev, manager->getCoalesceMode(id & asTYPEID_MASK_SEQNBR));
+}
+
+void EntitySystem::prepareGlobalEventWithTags(asIScriptObject * o, int id, uint32_t tagMask)
+{
+    if (o == nullptr)
+        return;
+
+    if (!CheckEventArgument(id, "ESM::QueueGlobalEvent called with illegal arguments"))
+        return;
+
+    int ev = manager->getEventIndex(id & asTYPEID_MASK_SEQNBR);
+    if (ev < 0)
+        return;
+
+    enqueueGlobalEvent(o, ev, manager->getCoalesceMode(id & asTYPEID_MASK_SEQNBR), tagMask);
 }
 
 void EntitySystem::prepareLocalEvent(Entity * e, asIScriptObject* o, int id)
@@ -78,20 +242,223 @@ void EntitySystem::prepareLocalEvent(Entity * e, asIScriptObject* o, int id)
     if (o == nullptr || e == nullptr)
         return;
 
+    if (!CheckEventArgument(id, "ESM::QueueLocalEvent called with illegal arguments"))
+        return;
 
-    if ((id & asTYPEID_SCRIPTOBJECT) == 0 || (id & asTYPEID_OBJHANDLE) != 0)
+    int ev = manager->getEventIndex(id & asTYPEID_MASK_SEQNBR);
+    if (ev < 0)
+        return;
+
+    enqueueLocalEvent(e, o, ev, manager->getCoalesceMode(id & asTYPEID_MASK_SEQNBR));
+}
+
+void EntitySystem::prepareGlobalEventAfter(asIScriptObject * o, int id, unsigned int ticks)
+{
+    if (o == nullptr)
+        return;
+
+    if (!CheckEventArgument(id, "ESM::QueueGlobalEventAfter called with illegal arguments"))
+        return;
+
+    int ev = manager->getEventIndex(id & asTYPEID_MASK_SEQNBR);
+    if (ev < 0)
+        return;
+
+    ++stat_timedEventsScheduled;
+    o->AddRef();
+    EventTimerWheel::Timer t;
+    t.entity = nullptr;
+    t.event = ev;
+    t.coalesce = manager->getCoalesceMode(id & asTYPEID_MASK_SEQNBR);
+    t.object = o;
+    timers.schedule(t, ticks);
+}
+
+void EntitySystem::prepareLocalEventAfter(Entity * e, asIScriptObject * o, int id, unsigned int ticks)
+{
+    if (o == nullptr || e == nullptr)
+        return;
+
+    if (!CheckEventArgument(id, "ESM::QueueLocalEventAfter called with illegal arguments"))
+        return;
+
+    int ev = manager->getEventIndex(id & asTYPEID_MASK_SEQNBR);
+    if (ev < 0)
+        return;
+
+    ++stat_timedEventsScheduled;
+    e->addRef();
+    o->AddRef();
+    EventTimerWheel::Timer t;
+    t.entity = e;
+    t.event = ev;
+    t.coalesce = manager->getCoalesceMode(id & asTYPEID_MASK_SEQNBR);
+    t.object = o;
+    timers.schedule(t, ticks);
+}
+
+DeferredCommandBuffer * EntitySystem::getCommandBuffer()
+{
+    auto& cache = CommandBufferCache;
+    uint64_t key = DeferredCommandKey;
+    if (cache.buffer && cache.serial == serial && cache.key == key)
+        return cache.buffer;
+
+    std::lock_guard<std::mutex> lk(commandBufferMutex);
+    auto& buffer = commandBuffers[key];
+    if (!buffer)
+        buffer.reset(new DeferredCommandBuffer());
+
+    cache.serial = serial;
+    cache.key = key;
+    cache.buffer = buffer.get();
+    return cache.buffer;
+}
+
+void EntitySystem::setDeferredCommandIndex(unsigned int index)
+{
+    DeferredCommandKey = index;
+}
+
+void EntitySystem::pushDeferred(DeferredCommandBuffer::Command * c)
+{
+    getCommandBuffer()->push(c);
+    hasDeferredCommands.store(true);
+}
+
+void EntitySystem::mergeDeferredCommands(bool apply)
+{
+    if (!hasDeferredCommands.exchange(false))
+        return;
+
+    //Taken out of the member, a factory may merge again from a nested
+    //updateEntityLists call while these are applied
+    std::vector<DeferredCommandBuffer::Command*> commands;
+    commands.swap(deferredCommands);
     {
-        auto* ctx = asGetActiveContext();
-        if (ctx)
+        std::lock_guard<std::mutex> lk(commandBufferMutex);
+        for (auto& b : commandBuffers)
         {
-            ctx->SetException("ESM::QueueGlobalEvent called with illegal arguments");
-            return;
+            auto* c = b.second->takeAll();
+            if (c)
+                commands.push_back(c);
+        }
+    }
+
+    //Applied without the lock, factories may defer more commands
+    for (auto* c : commands)
+    {
+        while (c)
+        {
+            ++stat_deferredCommands;
+            auto* next = c->next;
+            switch (c->type)
+            {
+            case DeferredCommandBuffer::Spawn:
+                if (apply)
+                {
+                    Entity* e = constructEntity(c->mold);
+                    if (e)
+                        e->release();
+                }
+                break;
+            case DeferredCommandBuffer::Kill:
+                //Living entities are referenced by the system as well
+                if (apply && !c->entity->dead)
+                    killEntity(c->entity);
+                break;
+            case DeferredCommandBuffer::LocalEvent:
+                if (apply)
+                    enqueueLocalEvent(c->entity, c->event, c->eventIndex, c->coalesce);
+                break;
+            case DeferredCommandBuffer::GlobalEvent:
+                if (apply)
+                    enqueueGlobalEvent(c->event, c->eventIndex, c->coalesce);
+                break;
+            }
+            if (c->entity)
+                c->entity->release();
+            if (c->event)
+                c->event->Release();
+            delete c;
+            c = next;
         }
     }
+    commands.clear();
+    if (deferredCommands.empty())
+        deferredCommands.swap(commands);
+}
+
+void EntitySystem::deferConstructEntity(const EntityType * type)
+{
+    auto* c = new DeferredCommandBuffer::Command();
+    c->type = DeferredCommandBuffer::Spawn;
+    c->mold = type;
+    pushDeferred(c);
+}
+
+void EntitySystem::deferKillEntity(Entity * e)
+{
+    e->addRef();
+    auto* c = new DeferredCommandBuffer::Command();
+    c->type = DeferredCommandBuffer::Kill;
+    c->entity = e;
+    pushDeferred(c);
+}
+
+void EntitySystem::deferLocalEvent(Entity * e, asIScriptObject * o, int id)
+{
+    if (o == nullptr || e == nullptr)
+        return;
+
+    if (!CheckEventArgument(id, "ESM::DeferLocalEvent called with illegal arguments"))
+        return;
+
+    int ev = manager->getEventIndex(id & asTYPEID_MASK_SEQNBR);
+    if (ev < 0)
+        return;
 
     e->addRef();
     o->AddRef();
-    preparedLocalEvents.push_back({ e, { (unsigned int)id & asTYPEID_MASK_SEQNBR, o} });
+    auto* c = new DeferredCommandBuffer::Command();
+    c->type = DeferredCommandBuffer::LocalEvent;
+    c->entity = e;
+    c->event = o;
+    c->eventIndex = ev;
+    c->coalesce = manager->getCoalesceMode(id & asTYPEID_MASK_SEQNBR);
+    pushDeferred(c);
+}
+
+void EntitySystem::deferGlobalEvent(asIScriptObject * o, int id)
+{
+    if (o == nullptr)
+        return;
+
+    if (!CheckEventArgument(id, "ESM::DeferGlobalEvent called with illegal arguments"))
+        return;
+
+    int ev = manager->getEventIndex(id & asTYPEID_MASK_SEQNBR);
+    if (ev < 0)
+        return;
+
+    o->AddRef();
+    auto* c = new DeferredCommandBuffer::Command();
+    c->type = DeferredCommandBuffer::GlobalEvent;
+    c->event = o;
+    c->eventIndex = ev;
+    c->coalesce = manager->getCoalesceMode(id & asTYPEID_MASK_SEQNBR);
+    pushDeferred(c);
+}
+
+void EntitySystem::releaseTimers(std::vector<EventTimerWheel::Timer>& vec)
+{
+    for (auto& t : vec)
+    {
+        if (t.entity)
+            t.entity->release();
+        t.object->Release();
+    }
+    vec.clear();
 }
 
 bool EntitySystem::sendEvents()
@@ -104,48 +471,112 @@ bool EntitySystem::sendEvents()
         return false;
     }
 
+    mergeDeferredCommands();
+
+    //One tick per call, due events join the ones already queued
+    timers.advance(dueTimers);
+    for (auto& t : dueTimers)
+    {
+        if (t.entity == nullptr)
+            enqueueGlobalEvent(t.object, t.event, t.coalesce);
+        else if (t.entity->dead == false)
+            enqueueLocalEvent(t.entity, t.object, t.event, t.coalesce);
+        else
+            ++stat_timedEventsDropped;
+    }
+    releaseTimers(dueTimers);
+
     auto* ctx = engine->RequestContext();
 
     std::swap(preparedGlobalEvents, preparedGlobalEventsSwap);
+    coalescedTaggedGlobalEvents.clear();
+    ++globalQueueStamp;
     for (auto& r : preparedGlobalEventsSwap)
     {
         ++stat_globalEventsSent;
-        //TODO: optimize?
-        //Use an entityiterator just to check for iterator invalidation
-        //somebody abuses
-        EntityIterator* ei = constructEntityIterator();
-        auto it = componentsByEvent.find(r.id);
-
-        if (it != componentsByEvent.end())
-        for (std::pair<Component*, unsigned int>& p : it->second)
+        //Handlers might abuse the entity lists, which would pull the
+        //chunks from under us
+        size_t epoch = structureEpoch;
+        size_t bindingCount = r.id < componentsByEvent.size() ? componentsByEvent[r.id].size() : 0;
+
+        //[Every=N] handlers see the components whose stagger matches this send
+        if (r.id >= eventDispatchCounts.size())
+            eventDispatchCounts.resize(r.id + 1, 0);
+        size_t dispatchCount = eventDispatchCounts[r.id]++;
+
+        asIScriptFunction* lastHandler = nullptr;
+        for (size_t bi = 0; bi < bindingCount; bi++)
         {
-            auto* c = p.first;
-                
-            auto* obj = c->object;
-            if (obj == nullptr)
+            ArchetypeEventBinding& b = componentsByEvent[r.id][bi];
+            if (b.handler != lastHandler)
+            {
+                ++stat_handlerGroupsDispatched;
+                lastHandler = b.handler;
+            }
+            unsigned int phase = (unsigned int)(dispatchCount % b.every);
+            if (b.parallelSafe && workerPool)
+            {
+                for (auto& chunk : b.archetype->chunks)
+                    parallelTasks.push_back({ b.handler, chunk->column(b.slot), chunk->count, chunk->tags.data(), r.tagMask,
+                                              chunk->entities.data(), b.slot, b.every, phase });
                 continue;
-            auto* func = c->componentClass->eventHandlers[p.second].second;
-
-            ctx->Prepare(func);
-            ctx->SetObject(obj);
-            ctx->SetArgAddress(0, r.event);
-            ctx->Execute();
+            }
 
-            if (ei->invalidated)
-            {
-                //use the inbuilt exception system in entity iterator
-                //to write the exception
-                ei->next();
+            //Handlers run in declaration order, finish the parallel ones
+            //declared before this one
+            flushParallelTasks(r.event, ctx, epoch);
+            if (epoch != structureEpoch)
                 break;
+            for (auto& chunk : b.archetype->chunks)
+            {
+                asIScriptObject** objects = chunk->column(b.slot);
+                const uint32_t* tags = chunk->tags.data();
+                Entity* const* entities = chunk->entities.data();
+                for (size_t row = 0; row < chunk->count; ++row)
+                {
+                    auto* obj = objects[row];
+                    if (obj == nullptr)
+                        continue;
+                    if ((tags[row] & r.tagMask) != r.tagMask)
+                        continue;
+                    if (b.every > 1 && entities[row]->getStagger(b.slot) % b.every != phase)
+                    {
+                        ++stat_staggeredSkips;
+                        continue;
+                    }
+
+                    ++stat_handlerCalls;
+                    ctx->Prepare(b.handler);
+                    ctx->SetObject(obj);
+                    ctx->SetArgAddress(0, r.event);
+                    ctx->Execute();
+
+                    //the chunks may have been reallocated, stop right away
+                    if (epoch != structureEpoch)
+                        break;
+                }
+                if (epoch != structureEpoch)
+                    break;
             }
+            if (epoch != structureEpoch)
+                break;
+        }
+
+        flushParallelTasks(r.event, ctx, epoch);
+
+        if (epoch != structureEpoch)
+        {
+            auto* actx = asGetActiveContext();
+            if (actx)
+                actx->SetException("ESM::SendEvents entity lists updated during global event");
         }
 
         r.event->Release();
-        releaseEntityIterator(ei);
     }
     preparedGlobalEventsSwap.clear();
 
     std::swap(preparedLocalEvents, preparedLocalEventsSwap);
+    coalescedLocalEvents.clear();
     for (auto& r : preparedLocalEventsSwap)
     {
         ++stat_localEventsSent;
@@ -166,62 +597,72 @@ void EntitySystem::cleanUp()
 {
     invalidateIterators();
 
+    //Cost scales with the number of deaths, not with the world size
+    for (Entity* e : killedEntities)
     {
-        auto it = componentsByClass.begin();
-        while (it != componentsByClass.end())
-        {
-            std::vector<Component*>& cv = it->second;
-            cv.erase(std::remove_if(cv.begin(), cv.end(), [&]
-            (Component* c) {
-                if (c->dead && (c->entity->reused == false))
-                {
-                    return true;
-                }
-                return false;
-            }), cv.end());
+        e->killPending = false;
 
-            if (cv.size() == 0)
-            {
-                ++it;
-                //it = componentsByClass.erase(it);
-            }
-            else
-            {
-                ++it;
-            }
-        }
+        //Killed before it was spawned, the spawn revived it or it is
+        //still waiting in entitiesToSpawn
+        if (!e->dead)
+            continue;
+        if (e->listIndex >= allEntities.size() || allEntities[e->listIndex] != e)
+            continue;
+
+        if (e->chunk)
+            getArchetype(e->type)->remove(e);
+
+        Entity* last = allEntities.back();
+        allEntities[e->listIndex] = last;
+        last->listIndex = e->listIndex;
+        allEntities.pop_back();
+
+        recycleEntity(e);
     }
+    killedEntities.clear();
+}
 
+void EntitySystem::applyDormancyChanges()
+{
+    for (Entity* e : dormancyChanges)
     {
-        auto it = componentsByEvent.begin();
-        while (it != componentsByEvent.end())
+        e->dormancyPending = false;
+        bool spawned = e->listIndex < allEntities.size() && allEntities[e->listIndex] == e;
+        if (e->dead || !spawned || e->dormant == e->dormantRequested)
         {
-            std::vector<std::pair<Component*, unsigned int>>& cv = it->second;
-            cv.erase(std::remove_if(cv.begin(), cv.end(), [&]
-            (const std::pair<Component*, unsigned int>& p) {
-                if (p.first->dead && (p.first->entity->reused == false))
-                {
-                    return true;
-                }
-                return false;
-            }), cv.end());
-
-            ++it;
+            e->release();
+            continue;
         }
+
+        ++stat_dormancyChanges;
+        touchClasses(e->type);
+        e->dormant = e->dormantRequested;
+        if (e->dormant)
+            getArchetype(e->type)->remove(e);
+        else
+            getArchetype(e->type)->add(e);
+        e->release();
     }
+    dormancyChanges.clear();
+}
 
+void EntitySystem::recycleEntity(Entity* e)
+{
+    //Recycle only if nobody else can observe the entity anymore
+    if (e->getRefCount() == 1)
+    {
+        unsigned int moldId = e->type->id;
+        if (moldId >= deadEntitiesByMold.size())
+            deadEntitiesByMold.resize(moldId + 1);
 
-    allEntities.erase(std::remove_if(allEntities.begin(), allEntities.end(), [&]
-    (Entity* e){
-        if (e->dead && (e->reused == false))
+        auto& vec = deadEntitiesByMold[moldId];
+        if (vec.size() < recycleLimit)
         {
-            e->release();
-            return true;
+            vec.push_back(e);
+            return;
         }
-        return false;
-    }), allEntities.end());
-
-    deadEntitiesByTypeHash.clear();
+    }
+    e->release();
 }
 
 void EntitySystem::updateEntityLists()
@@ -235,6 +676,8 @@ void EntitySystem::updateEntityLists()
     }
     //manager->log("List update - Killing  ", entitiesToKill.size(), " entities");
 
+    mergeDeferredCommands();
+
     asIScriptContext* ctx = engine->RequestContext();
     
     //If some abusers spawn entities or kill entities during initialization
@@ -244,38 +687,11 @@ void EntitySystem::updateEntityLists()
         std::swap(entitiesToSpawn, entitiesToSpawnSwap);
         for (Entity* e : entitiesToSpawnSwap)
         {
-            if (!(e->reused))
-            {
-                allEntities.push_back(e);
-                for (Component& c : e->components)
-                {
-                    auto it = componentsByClass.find(c.componentClass->id);
-                    if (it == componentsByClass.end())
-                    {
-                        
-                    }
-                    else
-                        it->second.push_back(&c);
-
-                    unsigned int index = 0;
-                    for (auto& evh : c.componentClass->eventHandlers)
-                    {
-                        auto it = componentsByEvent.find(evh.first);
-                        std::vector<std::pair<Component*, unsigned int>>* p;
-                        if (it == componentsByEvent.end())
-                        {
-                            componentsByEvent[evh.first] = std::vector<std::pair<Component*, unsigned int>>();
-                            p = &(componentsByEvent[evh.first]);
-                        }
-                        else
-                            p = &(it->second);
-                        p->push_back({ &c, index });
-                        ++index;
-                    }
-                }
-            }
+            e->listIndex = allEntities.size();
+            allEntities.push_back(e);
+            getArchetype(e->type)->add(e);
             e->setDead(false);
-            e->reused = false;
+            touchClasses(e->type);
         }
         //if some abuser uses component iterators in the init/deinit, break em
         invalidateIterators();
@@ -293,82 +709,411 @@ void EntitySystem::updateEntityLists()
                 continue;
             e->sendSpecialEventNowInContext(EntityEventDeinitId, ctx);
             e->setDead(true);
-
-            /*
-            if (!e->type->hasCollisions)
+            touchClasses(e->type);
+            releaseSlot(e);
+            spatialGrid.remove(e);
+            if (!e->killPending)
             {
-                std::vector<Entity*>* vec;
-                auto it = deadEntitiesByTypeHash.find(e->type->hash);
-                if (it == deadEntitiesByTypeHash.end())
-                {
-                    vec = new std::vector<Entity*>();
-                    deadEntitiesByTypeHash[e->type->hash] = std::unique_ptr<std::vector<Entity*>>(vec);
-                }
-                else
-                    vec = it->second.get();
-                vec->push_back(e);
+                e->killPending = true;
+                killedEntities.push_back(e);
             }
-            */
-
         }
         entitiesToKillSwap.clear();
     
     }
+    applyDormancyChanges();
     engine->ReturnContext(ctx);
     cleanUp();
 }
 
 Entity* EntitySystem::constructEntity(const EntityType * type)
 {
-    ++stat_entityConstructions;
-    if (!type->hasCollisions)
+    asIScriptContext* ctx = engine->RequestContext();
+    Entity* e = constructEntityInContext(type, ctx);
+    engine->ReturnContext(ctx);
+    return e;
+}
+
+void EntitySystem::constructEntities(const EntityType * type, unsigned int count, CScriptArray * out)
+{
+    //Grow geometrically, an exact reserve would reallocate on every burst
+    size_t needed = entitiesToSpawn.size() + count;
+    if (needed > entitiesToSpawn.capacity())
+        entitiesToSpawn.reserve(std::max(needed, entitiesToSpawn.capacity() * 2));
+
+    asIScriptContext* ctx = engine->RequestContext();
+    for (unsigned int i = 0; i < count; i++)
     {
-        auto it = deadEntitiesByTypeHash.find(type->hash);
-        if (it != deadEntitiesByTypeHash.end())
-        {
-            
-            auto& vec = *(it->second);
-            size_t index = 0;
-            size_t vsize = vec.size();
-            for (Entity* b : vec)
+        Entity* e = constructEntityInContext(type, ctx);
+        //the array takes over the returned reference
+        if (out)
+            *(Entity**)out->At(i) = e;
+        else
+            e->release();
+    }
+    engine->ReturnContext(ctx);
+}
+
+CScriptArray * EntitySystem::constructEntitiesArray(const EntityType * type, unsigned int count)
+{
+    //Without the array the entities would be unreachable, construct nothing.
+    //Create has set the script exception already.
+    CScriptArray* arr = CScriptArray::Create(manager->getEntityArrayType(), count);
+    if (arr == nullptr)
+        return nullptr;
+    constructEntities(type, count, arr);
+    return arr;
+}
+
+void EntitySystem::spawnEntities(const EntityType * type, unsigned int count)
+{
+    constructEntities(type, count, nullptr);
+}
+
+void EntitySystem::setPosition(Entity * e, float x, float y, float z)
+{
+    if (e->dead)
+        return;
+    spatialGrid.set(e, x, y, z);
+}
+
+void EntitySystem::removePosition(Entity * e)
+{
+    spatialGrid.remove(e);
+}
+
+void EntitySystem::setSpatialCellSize(float size)
+{
+    if (!(size > 0.0f))
+    {
+        asIScriptContext* ctx = asGetActiveContext();
+        if (ctx)
+            ctx->SetException("ESM::SetSpatialCellSize size must be positive");
+        return;
+    }
+    spatialGrid.setCellSize(size);
+}
+
+CScriptArray * EntitySystem::spatialResultsArray()
+{
+    CScriptArray* arr = CScriptArray::Create(manager->getEntityArrayType(), (asUINT)spatialResults.size());
+    for (size_t i = 0; i < spatialResults.size(); i++)
+    {
+        Entity* e = spatialResults[i];
+        e->addRef();
+        *(Entity**)arr->At((asUINT)i) = e;
+    }
+    spatialResults.clear();
+    return arr;
+}
+
+CScriptArray * EntitySystem::queryRadius(float x, float y, float z, float radius)
+{
+    spatialResults.clear();
+    spatialGrid.queryRadius(x, y, z, radius, spatialResults);
+    return spatialResultsArray();
+}
+
+template<class F>
+void EntitySystem::forEachLiveComponent(ComponentClass * cls, F f)
+{
+    if (cls->index >= componentsByClass.size())
+        return;
+    for (auto& col : componentsByClass[cls->index])
+    {
+        for (auto& chunk : col.archetype->chunks)
+        {
+            asIScriptObject** objects = chunk->column(col.slot);
+            for (size_t row = 0; row < chunk->count; ++row)
             {
-                //EntitySystem hold the only reference
-                if (b->getRefCount() == 1)
-                {
-                    //swap with last element
-                    if (index != vsize - 1)
-                    {
-                        vec[index] = std::move(vec[vsize - 1]);
-                    }
-                    //and resize
-                    vec.resize(vsize - 1);
-
-                    b->reused = true;
-                    b->id = getNextEntityId();
-                    buildEntityComponents(b);
-                    buildEntityComponentReferences(b, type);
-                    entitiesToSpawn.push_back(b);
-                    b->addRef();
-                    return b;
-                }
-                index++;
+                if (objects[row] != nullptr)
+                    f(objects[row]);
             }
-            
+        }
+    }
+}
+
+//! Float property for gather/scatter, other types would not survive the
+//! round trip through a float buffer
+static const NumericProperty* FindFloatProperty(ComponentClass* cls, const char* property)
+{
+    const NumericProperty* prop = cls->findNumericProperty(property);
+    if (prop == nullptr || prop->typeId != asTYPEID_FLOAT)
+        return nullptr;
+    return prop;
+}
+
+bool EntitySystem::gatherProperty(ComponentClass * cls, const char * property, std::vector<float>& out)
+{
+    const NumericProperty* prop = FindFloatProperty(cls, property);
+    if (prop == nullptr)
+        return false;
+
+    size_t first = out.size();
+    int offset = prop->offset;
+    forEachLiveComponent(cls, [&](asIScriptObject* obj) {
+        out.push_back(*(const float*)((const char*)obj + offset));
+    });
+
+    if (cls->index >= gatherStates.size())
+        gatherStates.resize(cls->index + 1, { (size_t)-1, 0 });
+    gatherStates[cls->index] = { structureEpoch, out.size() - first };
+    return true;
+}
+
+bool EntitySystem::scatterProperty(ComponentClass * cls, const char * property, const float * values, size_t count)
+{
+    const NumericProperty* prop = FindFloatProperty(cls, property);
+    if (prop == nullptr)
+        return false;
+
+    //The same epoch means the same live components in the same order
+    if (cls->index >= gatherStates.size() || gatherStates[cls->index].first != structureEpoch)
+        return false;
+    if (gatherStates[cls->index].second != count)
+        return false;
+
+    size_t i = 0;
+    int offset = prop->offset;
+    forEachLiveComponent(cls, [&](asIScriptObject* obj) {
+        *(float*)((char*)obj + offset) = values[i];
+        ++i;
+    });
+    return true;
+}
+
+//! Unsigned integer with the same ordering as the numeric property value
+static uint64_t SortKey(const char* p, int typeId)
+{
+    switch (typeId)
+    {
+    //Flipping the sign bit moves the negative values below the positive
+    case asTYPEID_INT8: return (uint32_t)(int32_t)*(const int8_t*)p ^ 0x80000000u;
+    case asTYPEID_INT16: return (uint32_t)(int32_t)*(const int16_t*)p ^ 0x80000000u;
+    case asTYPEID_INT32: return (uint32_t)*(const int32_t*)p ^ 0x80000000u;
+    case asTYPEID_INT64: return (uint64_t)*(const int64_t*)p ^ 0x8000000000000000ull;
+    case asTYPEID_UINT8: return *(const uint8_t*)p;
+    case asTYPEID_UINT16: return *(const uint16_t*)p;
+    case asTYPEID_UINT32: return *(const uint32_t*)p;
+    case asTYPEID_UINT64: return *(const uint64_t*)p;
+    case asTYPEID_DOUBLE:
+    {
+        uint64_t u;
+        memcpy(&u, p, sizeof(u));
+        //Negative values order reversed by magnitude, flip all their bits
+        return (u & 0x8000000000000000ull) ? ~u : (u | 0x8000000000000000ull);
+    }
+    default:
+    {
+        uint32_t u;
+        memcpy(&u, p, sizeof(u));
+        return (u & 0x80000000u) ? (uint32_t)~u : (u | 0x80000000u);
+    }
+    }
+}
+
+//! Significant bits of the sort keys of the property type
+static unsigned int SortKeyBits(int typeId)
+{
+    switch (typeId)
+    {
+    case asTYPEID_INT64:
+    case asTYPEID_UINT64:
+    case asTYPEID_DOUBLE:
+        return 64;
+    default:
+        return 32;
+    }
+}
+
+//! Stable insertion sort, gives up after moving elements budget times
+static bool InsertionSort(std::vector<asIScriptObject*>& objects, std::vector<uint64_t>& keys, size_t budget)
+{
+    size_t moves = 0;
+    for (size_t i = 1; i < keys.size(); i++)
+    {
+        uint64_t key = keys[i];
+        if (keys[i - 1] <= key)
+            continue;
+        asIScriptObject* obj = objects[i];
+        size_t j = i;
+        while (j > 0 && keys[j - 1] > key)
+        {
+            keys[j] = keys[j - 1];
+            objects[j] = objects[j - 1];
+            --j;
+            if (++moves > budget)
+            {
+                keys[j] = key;
+                objects[j] = obj;
+                return false;
+            }
+        }
+        keys[j] = key;
+        objects[j] = obj;
+    }
+    return true;
+}
+
+void EntitySystem::radixSort(std::vector<asIScriptObject*>& objects, std::vector<uint64_t>& keys, unsigned int bits)
+{
+    size_t n = keys.size();
+    sortObjectsScratch.resize(n);
+    sortKeysScratch.resize(n);
+
+    //Least significant byte first, every pass is stable
+    for (unsigned int shift = 0; shift < bits; shift += 8)
+    {
+        size_t offsets[256] = {};
+        for (size_t i = 0; i < n; i++)
+            ++offsets[(keys[i] >> shift) & 0xFF];
+
+        //All the keys share the byte, the pass would not move anything
+        if (offsets[(keys[0] >> shift) & 0xFF] == n)
+            continue;
+
+        size_t sum = 0;
+        for (size_t& o : offsets)
+        {
+            size_t c = o;
+            o = sum;
+            sum += c;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t dst = offsets[(keys[i] >> shift) & 0xFF]++;
+            sortKeysScratch[dst] = keys[i];
+            sortObjectsScratch[dst] = objects[i];
+        }
+        keys.swap(sortKeysScratch);
+        objects.swap(sortObjectsScratch);
+    }
+}
+
+std::shared_ptr<const std::vector<asIScriptObject*>> EntitySystem::sortComponents(ComponentClass * cls, const NumericProperty * prop)
+{
+    uint64_t cacheKey = ((uint64_t)cls->index << 32) | (uint32_t)prop->offset;
+    SortCache& cache = sortCaches[cacheKey];
+
+    //Iterators may still hold the previous order, never sort under them
+    if (!cache.order)
+        cache.order = std::make_shared<std::vector<asIScriptObject*>>();
+    else if (cache.order.use_count() > 1)
+        cache.order = std::make_shared<std::vector<asIScriptObject*>>(*cache.order);
+
+    auto& order = *cache.order;
+    auto& keys = cache.keys;
+    int offset = prop->offset;
+    int typeId = prop->typeId;
+
+    //Iterators are invalidated by every list update, the class epoch only
+    //when the live components of this class change
+    size_t epoch = getClassEpoch(cls);
+    bool sorted = false;
+    if (cache.epoch == epoch)
+    {
+        //Same components as the last time, only the values may differ
+        for (size_t i = 0; i < order.size(); i++)
+            keys[i] = SortKey((const char*)order[i] + offset, typeId);
+        sorted = InsertionSort(order, keys, order.size() * 4);
+        if (sorted)
+            ++stat_incrementalSorts;
+    }
+    else
+    {
+        order.clear();
+        keys.clear();
+        forEachLiveComponent(cls, [&](asIScriptObject* obj) {
+            order.push_back(obj);
+            keys.push_back(SortKey((const char*)obj + offset, typeId));
+        });
+    }
+
+    if (!sorted && order.size() > 1)
+    {
+        ++stat_radixSorts;
+        radixSort(order, keys, SortKeyBits(typeId));
+    }
+    cache.epoch = epoch;
+    return cache.order;
+}
+
+CScriptArray * EntitySystem::gatherFloatArray(unsigned int classId, const std::string & property)
+{
+    ComponentClass* cls = manager->getClassBySeq(classId);
+    gatherBuffer.clear();
+    if (cls == nullptr || !gatherProperty(cls, property.c_str(), gatherBuffer))
+    {
+        asIScriptContext* ctx = asGetActiveContext();
+        if (ctx)
+            ctx->SetException("ESM::GatherFloat called with an unknown component class or float property");
+        return nullptr;
+    }
+
+    CScriptArray* arr = CScriptArray::Create(manager->getFloatArrayType(), (asUINT)gatherBuffer.size());
+    if (gatherBuffer.size() > 0)
+        memcpy(arr->GetBuffer(), gatherBuffer.data(), gatherBuffer.size() * sizeof(float));
+    return arr;
+}
+
+void EntitySystem::scatterFloatArray(unsigned int classId, const std::string & property, CScriptArray * values)
+{
+    ComponentClass* cls = manager->getClassBySeq(classId);
+    float* data = values->GetSize() > 0 ? (float*)values->GetBuffer() : nullptr;
+    if (cls == nullptr || !scatterProperty(cls, property.c_str(), data, values->GetSize()))
+    {
+        asIScriptContext* ctx = asGetActiveContext();
+        if (ctx)
+            ctx->SetException("ESM::ScatterFloat failed, not a float property, the entity lists changed after ESM::GatherFloat or the array size differs");
+    }
+}
+
+CScriptArray * EntitySystem::queryBox(float minX, float minY, float minZ, float maxX, float maxY, float maxZ)
+{
+    spatialResults.clear();
+    spatialGrid.queryBox(minX, minY, minZ, maxX, maxY, maxZ, spatialResults);
+    return spatialResultsArray();
+}
+
+Entity* EntitySystem::constructEntityInContext(const EntityType * type, asIScriptContext* ctx)
+{
+    ++stat_entityConstructions;
+    if (type->id < deadEntitiesByMold.size())
+    {
+        auto& vec = deadEntitiesByMold[type->id];
+        if (vec.size() > 0)
+        {
+            //The system holds the only reference, see recycleEntity
+            Entity* b = vec.back();
+            vec.pop_back();
+
+            ++stat_entitiesRecycled;
+            b->setDead(false);
+            b->tags = 0;
+            b->dormant = false;
+            b->dormantRequested = false;
+            b->id = getNextEntityId();
+            acquireSlot(b);
+            buildEntityComponents(b, ctx);
+            buildEntityComponentReferences(b, type);
+            entitiesToSpawn.push_back(b);
+            b->addRef();
+            return b;
         }
     }
 
     //The only place where entities are construced
 
-    Entity* n = new Entity();
+    Entity* n = getSlab(type)->allocate();
     n->system = this;
     n->type = type;
-    n->components.reserve(type->componentTypes.size());
     n->id = getNextEntityId();
-    for (ComponentClass* c : type->componentTypes)
+    acquireSlot(n);
+    for (size_t i = 0; i < type->componentTypes.size(); i++)
     {
-        n->components.push_back(Component(c, n));
+        n->components[i].componentClass = type->componentTypes[i];
     }
-    buildEntityComponents(n);
+    buildEntityComponents(n, ctx);
     buildEntityComponentReferences(n, type);
     entitiesToSpawn.push_back(n);
 
@@ -398,81 +1143,243 @@ void EntitySystem::killEntity(Entity * e)
     entitiesToKill.push_back(e);
 }
 
+void EntitySystem::acquireSlot(Entity * e)
+{
+    uint32_t index;
+    if (freeEntitySlots.size() > 0)
+    {
+        index = freeEntitySlots.back();
+        freeEntitySlots.pop_back();
+    }
+    else
+    {
+        index = entitySlots.size();
+        entitySlots.push_back(EntitySlot());
+    }
+    entitySlots[index].entity = e;
+    e->slot = index;
+}
+
+void EntitySystem::releaseSlot(Entity * e)
+{
+    if (e->slot == 0)
+        return;
+    EntitySlot& s = entitySlots[e->slot];
+    s.entity = nullptr;
+    ++s.generation;
+    //generation 0 would match zeroed handles
+    if (s.generation == 0)
+        s.generation = 1;
+    freeEntitySlots.push_back(e->slot);
+    e->slot = 0;
+}
+
+Entity * EntitySystem::resolve(EntityId id) const
+{
+    if (id.index == 0 || id.index >= entitySlots.size())
+        return nullptr;
+    const EntitySlot& s = entitySlots[id.index];
+    if (s.generation != id.generation)
+        return nullptr;
+    return s.entity;
+}
+
+Entity * EntitySystem::resolveHandle(EntityId * id)
+{
+    Entity* e = resolve(*id);
+    if (e)
+        e->addRef();
+    return e;
+}
+
+bool EntitySystem::isHandleAlive(EntityId * id)
+{
+    return resolve(*id) != nullptr;
+}
+
 void EntitySystem::clear()
 {
     clearPreparedEvents();
+    invalidateIterators();
+    spatialGrid.clear();
+
+    //detach first, releasing may destroy the entities
+    for (auto& a : archetypes)
+    {
+        if (a)
+            a->detachAll();
+    }
+    archetypes.clear();
+    ++archetypeGeneration;
+
+    for (Entity* e : dormancyChanges)
+    {
+        e->dormancyPending = false;
+        e->release();
+    }
+    dormancyChanges.clear();
+    staggerCounters.clear();
 
     for (Entity* e : entitiesToSpawn)
     {
         e->setDead(true);
+        releaseSlot(e);
         e->release();
     }
 
     for (Entity* e : allEntities)
     {
         e->setDead(true);
+        releaseSlot(e);
         e->release();
     }
 
+    for (auto& vec : deadEntitiesByMold)
+    {
+        for (Entity* e : vec)
+            e->release();
+    }
+
     allEntities.clear();
+    killedEntities.clear();
     entitiesToSpawn.clear();
     entitiesToKill.clear();
     componentsByEvent.clear();
-    deadEntitiesByTypeHash.clear();
+    deadEntitiesByMold.clear();
     componentsByClass.clear();
     componentsByEvent.clear();
 
     stat_entityIteratorsConstructed = 0;
     stat_componentIteratorsConstructed = 0;
+    stat_entityIteratorPoolHits = 0;
+    stat_componentIteratorPoolHits = 0;
+    stat_queriesConstructed = 0;
+    stat_queryPoolHits = 0;
+    stat_cachedQueryRebuilds = 0;
+    stat_radixSorts = 0;
+    stat_incrementalSorts = 0;
     stat_entityConstructions = 0;
+    stat_entitiesRecycled = 0;
     stat_globalEventsSent = 0;
     stat_localEventsSent = 0;
+    stat_eventsCoalesced = 0;
+    stat_timedEventsScheduled = 0;
+    stat_timedEventsDropped = 0;
+    stat_deferredCommands = 0;
+    stat_componentsCloned = 0;
+    stat_dormancyChanges = 0;
+    stat_handlerGroupsDispatched = 0;
+    stat_handlerCalls = 0;
+    stat_staggeredSkips = 0;
+    stat_parallelTasks = 0;
     lastEntityId = 0;
+    eventDispatchCounts.clear();
+    gatherStates.clear();
+    sortCaches.clear();
+}
+
+void* EntitySystem::allocateIterator(std::vector<void*>& pool, size_t size, size_t& hits)
+{
+    if (pool.empty())
+        return ::operator new(size);
+
+    ++hits;
+    void* p = pool.back();
+    pool.pop_back();
+    return p;
 }
 
 ComponentIterator * EntitySystem::constructComponentIterator(asITypeInfo * type)
+{
+    return constructComponentIteratorWithTags(type, 0);
+}
+
+ComponentIterator * EntitySystem::constructComponentIteratorWithTags(asITypeInfo * type, uint32_t tagMask)
 {
     ++stat_componentIteratorsConstructed;
 
-    auto it = componentsByClass.find(type->GetSubType()->GetTypeId() & asTYPEID_MASK_SEQNBR);
-    ComponentIterator* ci;
-    if (it == componentsByClass.end())
-    {
-        ci = new ComponentIterator(this, nullptr);
-    }
-    else
-    {
-        ci = new ComponentIterator(this, &(it->second));
-    }
-    activeComponentIterators.insert(ci);
-    return ci;
+    auto* cls = manager->getClassBySeq(type->GetSubType()->GetTypeId() & asTYPEID_MASK_SEQNBR);
+    std::vector<ArchetypeColumn>* vec = nullptr;
+    if (cls != nullptr && cls->index < componentsByClass.size())
+        vec = &componentsByClass[cls->index];
+
+    void* p = allocateIterator(componentIteratorPool, sizeof(ComponentIterator), stat_componentIteratorPoolHits);
+    return new (p) ComponentIterator(this, vec, tagMask);
 }
 
 void EntitySystem::releaseComponentIterator(ComponentIterator * ci)
 {
-    if (ci)
-    {
-        activeComponentIterators.erase(ci);
-        delete ci;
-    }
+    ci->~ComponentIterator();
+    componentIteratorPool.push_back(ci);
 }
 
-EntityIterator * EntitySystem::constructEntityIterator()
+EntityIterator * EntitySystem::constructEntityIterator(uint32_t tagMask)
 {
     ++stat_entityIteratorsConstructed;
-    EntityIterator* ei;
-    ei = new EntityIterator(this, &allEntities);
-    activeEntityIterators.insert(ei);
-    return ei;
+
+    void* p = allocateIterator(entityIteratorPool, sizeof(EntityIterator), stat_entityIteratorPoolHits);
+    return new (p) EntityIterator(this, &allEntities, tagMask);
 }
 
 void EntitySystem::releaseEntityIterator(EntityIterator * ei)
 {
-    if (ei)
+    ei->~EntityIterator();
+    entityIteratorPool.push_back(ei);
+}
+
+SortedComponentIterator * EntitySystem::constructSortedComponentIterator(asITypeInfo * type, const std::string & property)
+{
+    ++stat_componentIteratorsConstructed;
+
+    auto* cls = manager->getClassBySeq(type->GetSubType()->GetTypeId() & asTYPEID_MASK_SEQNBR);
+    const NumericProperty* prop = cls ? cls->findNumericProperty(property.c_str()) : nullptr;
+    if (prop == nullptr)
     {
-        activeEntityIterators.erase(ei);
-        delete ei;
+        asIScriptContext* ctx = asGetActiveContext();
+        if (ctx)
+            ctx->SetException("SortedComponentIterator needs a component class and one of its numeric properties");
+        return nullptr;
     }
+
+    auto order = sortComponents(cls, prop);
+    void* p = allocateIterator(sortedIteratorPool, sizeof(SortedComponentIterator), stat_componentIteratorPoolHits);
+    return new (p) SortedComponentIterator(this, order);
+}
+
+void EntitySystem::releaseSortedComponentIterator(SortedComponentIterator * si)
+{
+    si->~SortedComponentIterator();
+    sortedIteratorPool.push_back(si);
+}
+
+ComponentQuery * EntitySystem::constructQuery(asITypeInfo * type)
+{
+    return constructQueryWithTags(type, 0);
+}
+
+ComponentQuery * EntitySystem::constructQueryWithTags(asITypeInfo * type, uint32_t tagMask)
+{
+    ++stat_queriesConstructed;
+
+    const MoldQuery* q = manager->getMoldQuery(type).get();
+    void* p = allocateIterator(queryPool, sizeof(ComponentQuery), stat_queryPoolHits);
+    return new (p) ComponentQuery(this, q, tagMask);
+}
+
+void EntitySystem::releaseQuery(ComponentQuery * q)
+{
+    q->~ComponentQuery();
+    queryPool.push_back(q);
+}
+
+CachedComponentQuery * EntitySystem::constructCachedQuery(asITypeInfo * type)
+{
+    return constructCachedQueryWithTags(type, 0);
+}
+
+CachedComponentQuery * EntitySystem::constructCachedQueryWithTags(asITypeInfo * type, uint32_t tagMask)
+{
+    return new CachedComponentQuery(this, type, manager->getMoldQuery(type), tagMask);
 }
 
 void EntitySystem::logDebugInfo()
@@ -483,62 +1390,226 @@ void EntitySystem::logDebugInfo()
     manager->log(EntitySystemManager::Info, "	Entities To Kill: ", entitiesToKill.size());
     manager->log(EntitySystemManager::Info, "	Active Component Classes: ", componentsByClass.size());
     manager->log(EntitySystemManager::Info, "	Active Component Classes By Event: ", componentsByEvent.size());
+
+    size_t archetypeCount = 0;
+    size_t chunkCount = 0;
+    for (auto& a : archetypes)
+    {
+        if (!a)
+            continue;
+        ++archetypeCount;
+        chunkCount += a->chunks.size();
+    }
+    manager->log(EntitySystemManager::Info, "	Archetypes: ", archetypeCount);
+    manager->log(EntitySystemManager::Info, "	Archetype Chunks: ", chunkCount);
+
+    size_t slabCount = 0;
+    size_t slabUsed = 0;
+    size_t slabCapacity = 0;
+    for (EntitySlab* s : slabs)
+    {
+        if (!s)
+            continue;
+        ++slabCount;
+        slabUsed += s->getUsed();
+        slabCapacity += s->getCapacity();
+    }
+    manager->log(EntitySystemManager::Info, "	Entity Slabs: ", slabCount);
+    manager->log(EntitySystemManager::Info, "	Entity Slab Occupancy: ", slabUsed, " / ", slabCapacity);
     
-    manager->log(EntitySystemManager::Info, "	Dead Entity Classes: ", deadEntitiesByTypeHash.size());
+    size_t deadMolds = 0;
     size_t totc = 0;
-    for (auto& r : deadEntitiesByTypeHash)
-        totc += r.second->size();
+    for (auto& vec : deadEntitiesByMold)
+    {
+        if (vec.size() > 0)
+            ++deadMolds;
+        totc += vec.size();
+    }
+    manager->log(EntitySystemManager::Info, "	Dead Entity Classes: ", deadMolds);
     manager->log(EntitySystemManager::Info, "	Total Dead Entities: ", totc);
     manager->log(EntitySystemManager::Info, "	Entity Mold Count: ", manager->entityMolds.size());
 
     manager->log(EntitySystemManager::Info, "	Global events sent: ", stat_globalEventsSent);
     manager->log(EntitySystemManager::Info, "	Local events sent: ", stat_localEventsSent);
+    manager->log(EntitySystemManager::Info, "	Events coalesced: ", stat_eventsCoalesced);
+    manager->log(EntitySystemManager::Info, "	Delayed events pending: ", timers.size());
+    manager->log(EntitySystemManager::Info, "	Delayed events scheduled: ", stat_timedEventsScheduled);
+    manager->log(EntitySystemManager::Info, "	Delayed events dropped: ", stat_timedEventsDropped);
+    manager->log(EntitySystemManager::Info, "	Deferred commands: ", stat_deferredCommands);
+    manager->log(EntitySystemManager::Info, "	Global handler groups dispatched: ", stat_handlerGroupsDispatched);
+    manager->log(EntitySystemManager::Info, "	Global handler calls: ", stat_handlerCalls);
+    manager->log(EntitySystemManager::Info, "	Global handler calls skipped by Every: ", stat_staggeredSkips);
+    manager->log(EntitySystemManager::Info, "	Parallel handler tasks: ", stat_parallelTasks);
     manager->log(EntitySystemManager::Info, "	Entities constructed: ", stat_entityConstructions);
+    manager->log(EntitySystemManager::Info, "	Entities recycled: ", stat_entitiesRecycled);
+    manager->log(EntitySystemManager::Info, "	Components cloned from prototypes: ", stat_componentsCloned);
+    manager->log(EntitySystemManager::Info, "	Dormancy changes: ", stat_dormancyChanges);
+    manager->log(EntitySystemManager::Info, "	Positioned entities: ", spatialGrid.size(), " in ", spatialGrid.cellCount(), " cells");
     manager->log(EntitySystemManager::Info, "	Component iterators constructed: ", stat_componentIteratorsConstructed);
     manager->log(EntitySystemManager::Info, "	Entity iterators constructed: ", stat_entityIteratorsConstructed);
+    manager->log(EntitySystemManager::Info, "	Component iterators from pool: ", stat_componentIteratorPoolHits);
+    manager->log(EntitySystemManager::Info, "	Entity iterators from pool: ", stat_entityIteratorPoolHits);
+    manager->log(EntitySystemManager::Info, "	Queries constructed: ", stat_queriesConstructed);
+    manager->log(EntitySystemManager::Info, "	Queries from pool: ", stat_queryPoolHits);
+    manager->log(EntitySystemManager::Info, "	Cached query rebuilds: ", stat_cachedQueryRebuilds);
+    manager->log(EntitySystemManager::Info, "	Radix sorts: ", stat_radixSorts);
+    manager->log(EntitySystemManager::Info, "	Incremental sorts: ", stat_incrementalSorts);
 }
 
 void EntitySystem::preallocate()
 {
-    for (auto& m : manager->classes)
+    if (componentsByClass.size() < manager->classes.size())
+        componentsByClass.resize(manager->classes.size());
+    if (componentsByEvent.size() < manager->eventCount)
+        componentsByEvent.resize(manager->eventCount);
+}
+
+void EntitySystem::flushParallelTasks(asIScriptObject * event, asIScriptContext * ctx, size_t epoch)
+{
+    if (parallelTasks.empty())
+        return;
+    if (epoch == structureEpoch)
     {
-        auto it = componentsByClass.find(m.first);
-        if (it == componentsByClass.end())
-        {
-            auto vec = std::vector<Component*>();
-            vec.reserve(1000);
-            componentsByClass[m.first] = std::move(vec);
-        }
+        stat_parallelTasks += parallelTasks.size();
+        workerPool->dispatch(parallelTasks, event, ctx);
     }
+    parallelTasks.clear();
 }
 
+void EntitySystem::setWorkerThreads(unsigned int threads)
+{
+    //The pool may be running handlers of the event being sent
+    if (preparedGlobalEventsSwap.size() > 0)
+    {
+        auto* ctx = asGetActiveContext();
+        if (ctx)
+            ctx->SetException("ESM::SetWorkerThreads called during ESM::SendEvents");
+        return;
+    }
+    workerPool = nullptr;
+    if (threads > 0)
+        workerPool = std::unique_ptr<EventWorkerPool>(new EventWorkerPool(engine, threads));
+}
 
-void EntitySystem::buildEntityComponents(Entity* entity)
+void EntitySystem::setRecycleLimit(size_t entities)
 {
-    asIScriptContext* ctx = engine->RequestContext();
-    for (auto& component : entity->components)
+    recycleLimit = entities;
+    for (auto& vec : deadEntitiesByMold)
     {
-        component.object = nullptr;
-        ctx->Prepare(component.componentClass->factory);
-        int res = ctx->Execute();
-        if (res != asEXECUTION_FINISHED)
-        {
-            manager->log(EntitySystemManager::Warning, "Failed to initialize component: ", ctx->GetExceptionString());
-        }
-        else
+        while (vec.size() > recycleLimit)
         {
-            component.object = *(asIScriptObject**)ctx->GetAddressOfReturnValue();
-            component.object->AddRef();
+            vec.back()->release();
+            vec.pop_back();
         }
     }
-    
-    engine->ReturnContext(ctx);
+}
 
+void EntitySystem::setSlabBlockSize(size_t entities)
+{
+    slabBlockSize = entities > 0 ? entities : 1;
 }
 
-void EntitySystem::buildEntityComponentReferences(Entity * entity, const EntityType * type)
+EntitySlab* EntitySystem::getSlab(const EntityType* type)
 {
-    for (auto& c : entity->components)
+    if (type->id < slabs.size() && slabs[type->id])
+        return slabs[type->id];
+
+    if (type->id >= slabs.size())
+        slabs.resize(type->id + 1, nullptr);
+
+    EntitySlab* s = new EntitySlab(type->componentTypes.size(), slabBlockSize);
+    slabs[type->id] = s;
+    return s;
+}
+
+EntityArchetype* EntitySystem::getArchetype(const EntityType* type)
+{
+    if (type->id < archetypes.size() && archetypes[type->id])
+        return archetypes[type->id].get();
+
+    if (type->id >= archetypes.size())
+        archetypes.resize(type->id + 1);
+
+    EntityArchetype* a = new EntityArchetype(type, archetypeChunkSize);
+    archetypes[type->id] = std::unique_ptr<EntityArchetype>(a);
+
+    //Classes or events may have been registered after preallocate
+    preallocate();
+
+    //Publish the columns for component iteration and event dispatch
+    for (size_t i = 0; i < type->componentTypes.size(); i++)
+    {
+        ComponentClass* c = type->componentTypes[i];
+        componentsByClass[c->index].push_back({ a, i });
+        for (auto& evh : c->eventHandlers)
+        {
+            //Keep the bindings grouped by handler, so that consecutive
+            //Prepare calls hit the same function fast path and the
+            //handler bytecode stays hot. Function ids follow the
+            //declaration order of the handlers.
+            auto& bindings = componentsByEvent[evh.event];
+            ArchetypeEventBinding b = { a, i, evh.function, evh.parallelSafe, evh.every };
+            auto pos = std::upper_bound(bindings.begin(), bindings.end(), b, []
+            (const ArchetypeEventBinding& l, const ArchetypeEventBinding& r) {
+                return l.handler->GetId() < r.handler->GetId();
+            });
+            bindings.insert(pos, b);
+        }
+    }
+    return a;
+}
+
+
+static asIScriptObject* RunComponentFactory(asIScriptFunction* factory, asIScriptContext* ctx, EntitySystemManager* manager)
+{
+    ctx->Prepare(factory);
+    int res = ctx->Execute();
+    if (res != asEXECUTION_FINISHED)
+    {
+        manager->log(EntitySystemManager::Warning, "Failed to initialize component: ", ctx->GetExceptionString());
+        return nullptr;
+    }
+    asIScriptObject* o = *(asIScriptObject**)ctx->GetAddressOfReturnValue();
+    o->AddRef();
+    return o;
+}
+
+void EntitySystem::buildEntityComponents(Entity* entity, asIScriptContext* ctx)
+{
+    bool cloning = entity->type->prototypeCloning;
+    for (auto& component : entity->components)
+    {
+        ComponentClass* cls = component.componentClass;
+        component.object = nullptr;
+
+        //Counted per class, entity ids may be allocated in strides
+        if (cls->index >= staggerCounters.size())
+            staggerCounters.resize(cls->index + 1, 0);
+        component.stagger = staggerCounters[cls->index]++;
+
+        if (cloning && cls->plainData)
+        {
+            if (cls->prototype == nullptr)
+                cls->prototype = RunComponentFactory(cls->factory, ctx, manager);
+
+            if (cls->prototype)
+            {
+                //Memberwise copy, no script is run
+                auto* o = (asIScriptObject*) engine->CreateUninitializedScriptObject(cls->typeInfo);
+                engine->AssignScriptObject(o, cls->prototype, cls->typeInfo);
+                component.object = o;
+                ++stat_componentsCloned;
+                continue;
+            }
+        }
+
+        component.object = RunComponentFactory(cls->factory, ctx, manager);
+    }
+}
+
+void EntitySystem::buildEntityComponentReferences(Entity * entity, const EntityType * type)
+{
+    for (auto& c : entity->components)
     {
         if (c.componentClass->entityReference.has)
         {
@@ -568,6 +1639,16 @@ void EntitySystem::buildEntityComponentReferences(Entity * entity, const EntityT
 }
 
 
+static void EntityMoldSetPrototypeCloning(bool enabled, EntityType* type)
+{
+    type->prototypeCloning = enabled;
+}
+
+static bool EntityMoldGetPrototypeCloning(EntityType* type)
+{
+    return type->prototypeCloning;
+}
+
 EntityType* EntitySystemManager::entityMoldFactory(uint32_t* list)
 {
     uint32_t cnt = *list;
@@ -587,6 +1668,14 @@ EntityType* EntitySystemManager::entityMoldFactory(uint32_t* list)
     return nullptr;
 }
 
+EntityType* EntitySystemManager::entityMoldFromArray(CScriptArray* arr)
+{
+    int i = getMoldId(arr);
+    if (i >= 0)
+        return getTypeByMoldId(i);
+    return nullptr;
+}
+
 
 
 void ComponentInfoConstruct(asITypeInfo* ti, void* v)
@@ -604,6 +1693,16 @@ unsigned int ComponentInfoGet(unsigned int* v)
     return *v;
 }
 
+void EntityIdConstruct(void* v)
+{
+    new (v) EntityId();
+}
+
+bool EntityIdEquals(const EntityId& other, EntityId* v)
+{
+    return *v == other;
+}
+
 void EntitySystemManager::registerEngine(asIScriptEngine* ase)
 {
     ase->AddRef();
@@ -635,6 +1734,45 @@ void EntitySystemManager::registerEngine(asIScriptEngine* ase)
     r = ase->RegisterObjectMethod("Entity", "uint sendEventNow(?&in)", asMETHOD(Entity, sendEventNow), asCALL_THISCALL);
     assert(r >= 0);
 
+    r = ase->RegisterObjectType("EntityId", sizeof(EntityId), asOBJ_VALUE | asOBJ_POD | asOBJ_APP_CLASS_ALLINTS | asGetTypeTraits<EntityId>());
+    assert(r >= 0);
+
+    r = ase->RegisterObjectBehaviour("EntityId", asBEHAVE_CONSTRUCT, "void f()", asFUNCTION(EntityIdConstruct), asCALL_CDECL_OBJLAST);
+    assert(r >= 0);
+
+    r = ase->RegisterObjectMethod("EntityId", "bool opEquals(const EntityId &in) const", asFUNCTION(EntityIdEquals), asCALL_CDECL_OBJLAST);
+    assert(r >= 0);
+
+    r = ase->RegisterObjectMethod("EntityId", "Entity@ get() const", asMETHOD(EntitySystem, resolveHandle), asCALL_THISCALL_OBJLAST, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterObjectMethod("EntityId", "bool get_alive() const", asMETHOD(EntitySystem, isHandleAlive), asCALL_THISCALL_OBJLAST, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterObjectMethod("Entity", "EntityId get_handle() const", asMETHOD(Entity, getHandle), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = ase->RegisterObjectMethod("Entity", "bool get_dormant() const", asMETHOD(Entity, isDormant), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = ase->RegisterObjectMethod("Entity", "void setDormant(bool)", asMETHOD(Entity, setDormant), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = ase->RegisterObjectMethod("Entity", "uint get_tags() const", asMETHOD(Entity, getTags), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = ase->RegisterObjectMethod("Entity", "void set_tags(uint)", asMETHOD(Entity, setTags), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = ase->RegisterObjectMethod("Entity", "void setTag(uint)", asMETHOD(Entity, setTag), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = ase->RegisterObjectMethod("Entity", "void clearTag(uint)", asMETHOD(Entity, clearTag), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = ase->RegisterObjectMethod("Entity", "bool hasTag(uint) const", asMETHOD(Entity, hasTag), asCALL_THISCALL);
+    assert(r >= 0);
+
 
     r = engine->RegisterObjectType("EntityMold", 0, asOBJ_REF | asOBJ_NOCOUNT);
     assert(r >= 0);
@@ -642,6 +1780,12 @@ void EntitySystemManager::registerEngine(asIScriptEngine* ase)
     r = engine->RegisterObjectBehaviour("EntityMold", asBEHAVE_LIST_FACTORY, "EntityMold@ f(int & in) {repeat int}", asMETHOD(EntitySystemManager, entityMoldFactory), asCALL_THISCALL_ASGLOBAL, this);
     assert(r >= 0);
 
+    r = engine->RegisterObjectMethod("EntityMold", "void set_prototypeCloning(bool)", asFUNCTION(EntityMoldSetPrototypeCloning), asCALL_CDECL_OBJLAST);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectMethod("EntityMold", "bool get_prototypeCloning() const", asFUNCTION(EntityMoldGetPrototypeCloning), asCALL_CDECL_OBJLAST);
+    assert(r >= 0);
+
 
 
     r = ase->SetDefaultNamespace("ESM");
@@ -654,10 +1798,43 @@ void EntitySystemManager::registerEngine(asIScriptEngine* ase)
     assert(r >= 0);
     */
 
+    r = ase->RegisterGlobalFunction("EntityMold@ GetMold(const array<uint> &in)", asMETHOD(EntitySystemManager, entityMoldFromArray), asCALL_THISCALL_ASGLOBAL, this);
+    assert(r >= 0);
+
     r = ase->RegisterGlobalFunction("Entity@ ConstructEntity(const EntityMold &)", asMETHODPR(EntitySystem, constructEntity, (const EntityType*), Entity*), asCALL_THISCALL_ASGLOBAL, this->system.get());
     assert(r >= 0);
 
 
+    r = ase->RegisterGlobalFunction("array<Entity@>@ ConstructEntities(const EntityMold &, uint)", asMETHOD(EntitySystem, constructEntitiesArray), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("void SpawnEntities(const EntityMold &, uint)", asMETHOD(EntitySystem, spawnEntities), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("void SetPosition(Entity&, float, float, float = 0)", asMETHOD(EntitySystem, setPosition), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("void RemovePosition(Entity&)", asMETHOD(EntitySystem, removePosition), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("void SetSpatialCellSize(float)", asMETHOD(EntitySystem, setSpatialCellSize), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("float GetSpatialCellSize()", asMETHOD(EntitySystem, getSpatialCellSize), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("array<Entity@>@ QueryRadius(float, float, float, float)", asMETHOD(EntitySystem, queryRadius), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("array<Entity@>@ QueryBox(float, float, float, float, float, float)", asMETHOD(EntitySystem, queryBox), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("array<float>@ GatherFloat(uint, const string &in)", asMETHOD(EntitySystem, gatherFloatArray), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("void ScatterFloat(uint, const string &in, const array<float> &in)", asMETHOD(EntitySystem, scatterFloatArray), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
     r = ase->RegisterGlobalFunction("void KillEntity(Entity&)", asMETHOD(EntitySystem, killEntity), asCALL_THISCALL_ASGLOBAL, this->system.get());
     assert(r >= 0);
 
@@ -680,6 +1857,39 @@ void EntitySystemManager::registerEngine(asIScriptEngine* ase)
     r = ase->RegisterGlobalFunction("void QueueGlobalEvent(?&in)", asMETHOD(EntitySystem, prepareGlobalEvent), asCALL_THISCALL_ASGLOBAL, this->system.get());
     assert(r >= 0);
 
+    r = ase->RegisterGlobalFunction("void QueueGlobalEvent(?&in, uint)", asMETHOD(EntitySystem, prepareGlobalEventWithTags), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("void QueueLocalEventAfter(Entity&, ?&in, uint)", asMETHOD(EntitySystem, prepareLocalEventAfter), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("void QueueGlobalEventAfter(?&in, uint)", asMETHOD(EntitySystem, prepareGlobalEventAfter), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("void DeferConstructEntity(const EntityMold &)", asMETHOD(EntitySystem, deferConstructEntity), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("void DeferKillEntity(Entity&)", asMETHOD(EntitySystem, deferKillEntity), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("void DeferLocalEvent(Entity&, ?&in)", asMETHOD(EntitySystem, deferLocalEvent), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("void DeferGlobalEvent(?&in)", asMETHOD(EntitySystem, deferGlobalEvent), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("void SetDeferredCommandIndex(uint)", asMETHOD(EntitySystem, setDeferredCommandIndex), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("void SetWorkerThreads(uint)", asMETHOD(EntitySystem, setWorkerThreads), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("uint GetWorkerThreads()", asMETHOD(EntitySystem, getWorkerThreads), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = ase->RegisterGlobalFunction("uint GetRadixSorts()", asMETHOD(EntitySystem, getRadixSorts), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
     r = ase->RegisterGlobalFunction("void LogDebugInfo()", asMETHOD(EntitySystem, logDebugInfo), asCALL_THISCALL_ASGLOBAL, this->system.get());
     assert(r >= 0);
 
@@ -692,12 +1902,111 @@ void EntitySystemManager::registerEngine(asIScriptEngine* ase)
     r = engine->RegisterObjectBehaviour("ComponentIterator<T>", asBEHAVE_FACTORY, "ComponentIterator<T> @f(int&in)", asMETHOD(EntitySystem, constructComponentIterator), asCALL_THISCALL_ASGLOBAL, this->system.get());
     assert(r >= 0);
 
+    r = engine->RegisterObjectBehaviour("ComponentIterator<T>", asBEHAVE_FACTORY, "ComponentIterator<T> @f(int&in, uint)", asMETHOD(EntitySystem, constructComponentIteratorWithTags), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
     r = engine->RegisterObjectBehaviour("ComponentIterator<T>", asBEHAVE_RELEASE, "void f()", asMETHOD(ComponentIterator, release), asCALL_THISCALL);
     assert(r >= 0);
 
     r = engine->RegisterObjectMethod("ComponentIterator<T>", "T@ next()", asMETHOD(ComponentIterator, next), asCALL_THISCALL);
     assert(r >= 0);
 
+    r = engine->RegisterObjectType("SortedComponentIterator<class T>", 0, asOBJ_REF | asOBJ_SCOPED | asOBJ_TEMPLATE);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectBehaviour("SortedComponentIterator<T>", asBEHAVE_FACTORY, "SortedComponentIterator<T> @f(int&in, const string &in)", asMETHOD(EntitySystem, constructSortedComponentIterator), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = engine->RegisterObjectBehaviour("SortedComponentIterator<T>", asBEHAVE_RELEASE, "void f()", asMETHOD(SortedComponentIterator, release), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectMethod("SortedComponentIterator<T>", "T@ next()", asMETHOD(SortedComponentIterator, next), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectType("Query<class A, class B>", 0, asOBJ_REF | asOBJ_SCOPED | asOBJ_TEMPLATE);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectBehaviour("Query<A, B>", asBEHAVE_FACTORY, "Query<A, B> @f(int&in)", asMETHOD(EntitySystem, constructQuery), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = engine->RegisterObjectBehaviour("Query<A, B>", asBEHAVE_FACTORY, "Query<A, B> @f(int&in, uint)", asMETHOD(EntitySystem, constructQueryWithTags), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = engine->RegisterObjectBehaviour("Query<A, B>", asBEHAVE_RELEASE, "void f()", asMETHOD(ComponentQuery, release), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectMethod("Query<A, B>", "bool next(A@ &out, B@ &out)", asMETHOD(ComponentQuery, next2), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectMethod("Query<A, B>", "Entity@ get_entity()", asMETHOD(ComponentQuery, getEntity), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectType("Query3<class A, class B, class C>", 0, asOBJ_REF | asOBJ_SCOPED | asOBJ_TEMPLATE);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectBehaviour("Query3<A, B, C>", asBEHAVE_FACTORY, "Query3<A, B, C> @f(int&in)", asMETHOD(EntitySystem, constructQuery), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = engine->RegisterObjectBehaviour("Query3<A, B, C>", asBEHAVE_FACTORY, "Query3<A, B, C> @f(int&in, uint)", asMETHOD(EntitySystem, constructQueryWithTags), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = engine->RegisterObjectBehaviour("Query3<A, B, C>", asBEHAVE_RELEASE, "void f()", asMETHOD(ComponentQuery, release), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectMethod("Query3<A, B, C>", "bool next(A@ &out, B@ &out, C@ &out)", asMETHOD(ComponentQuery, next3), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectMethod("Query3<A, B, C>", "Entity@ get_entity()", asMETHOD(ComponentQuery, getEntity), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectType("CachedQuery<class A, class B>", 0, asOBJ_REF | asOBJ_TEMPLATE);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectBehaviour("CachedQuery<A, B>", asBEHAVE_FACTORY, "CachedQuery<A, B> @f(int&in)", asMETHOD(EntitySystem, constructCachedQuery), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = engine->RegisterObjectBehaviour("CachedQuery<A, B>", asBEHAVE_FACTORY, "CachedQuery<A, B> @f(int&in, uint)", asMETHOD(EntitySystem, constructCachedQueryWithTags), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = engine->RegisterObjectBehaviour("CachedQuery<A, B>", asBEHAVE_ADDREF, "void f()", asMETHOD(CachedComponentQuery, addRef), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectBehaviour("CachedQuery<A, B>", asBEHAVE_RELEASE, "void f()", asMETHOD(CachedComponentQuery, release), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectMethod("CachedQuery<A, B>", "void reset()", asMETHOD(CachedComponentQuery, reset), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectMethod("CachedQuery<A, B>", "bool next(A@ &out, B@ &out)", asMETHOD(CachedComponentQuery, next2), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectMethod("CachedQuery<A, B>", "Entity@ get_entity()", asMETHOD(CachedComponentQuery, getEntity), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectType("CachedQuery3<class A, class B, class C>", 0, asOBJ_REF | asOBJ_TEMPLATE);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectBehaviour("CachedQuery3<A, B, C>", asBEHAVE_FACTORY, "CachedQuery3<A, B, C> @f(int&in)", asMETHOD(EntitySystem, constructCachedQuery), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = engine->RegisterObjectBehaviour("CachedQuery3<A, B, C>", asBEHAVE_FACTORY, "CachedQuery3<A, B, C> @f(int&in, uint)", asMETHOD(EntitySystem, constructCachedQueryWithTags), asCALL_THISCALL_ASGLOBAL, this->system.get());
+    assert(r >= 0);
+
+    r = engine->RegisterObjectBehaviour("CachedQuery3<A, B, C>", asBEHAVE_ADDREF, "void f()", asMETHOD(CachedComponentQuery, addRef), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectBehaviour("CachedQuery3<A, B, C>", asBEHAVE_RELEASE, "void f()", asMETHOD(CachedComponentQuery, release), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectMethod("CachedQuery3<A, B, C>", "void reset()", asMETHOD(CachedComponentQuery, reset), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectMethod("CachedQuery3<A, B, C>", "bool next(A@ &out, B@ &out, C@ &out)", asMETHOD(CachedComponentQuery, next3), asCALL_THISCALL);
+    assert(r >= 0);
+
+    r = engine->RegisterObjectMethod("CachedQuery3<A, B, C>", "Entity@ get_entity()", asMETHOD(CachedComponentQuery, getEntity), asCALL_THISCALL);
+    assert(r >= 0);
+
     r = engine->RegisterObjectType("ComponentInfo<class T>", sizeof(unsigned int), asOBJ_VALUE | asOBJ_TEMPLATE | asGetTypeTraits<unsigned int>());
     assert(r >= 0);
 
@@ -719,11 +2028,63 @@ void EntitySystemManager::registerEngine(asIScriptEngine* ase)
 }
 
 
+asITypeInfo* EntitySystemManager::getEntityArrayType()
+{
+    if (entityArrayTypeInfo == nullptr)
+    {
+        entityArrayTypeInfo = engine->GetTypeInfoByDecl("array<Entity@>");
+        entityArrayTypeInfo->AddRef();
+    }
+    return entityArrayTypeInfo;
+}
+
+asITypeInfo* EntitySystemManager::getFloatArrayType()
+{
+    if (floatArrayTypeInfo == nullptr)
+    {
+        floatArrayTypeInfo = engine->GetTypeInfoByDecl("array<float>");
+        floatArrayTypeInfo->AddRef();
+    }
+    return floatArrayTypeInfo;
+}
+
 EntitySystem* EntitySystemManager::getSystem()
 {
     return system.get();
 }
 
+static uint64_t HashComponentIds(const std::vector<uint32_t>& ids)
+{
+    //FNV-1a over the ids followed by the splitmix64 finalizer
+    uint64_t hash = 14695981039346656037ULL;
+    for (uint32_t id : ids)
+    {
+        hash ^= id;
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+void EntitySystemManager::growMoldTable()
+{
+    size_t size = moldTable.size() > 0 ? moldTable.size() * 2 : 64;
+    moldTable.assign(size, -1);
+
+    size_t mask = size - 1;
+    for (auto& m : entityMolds)
+    {
+        size_t bucket = m->hash & mask;
+        while (moldTable[bucket] >= 0)
+            bucket = (bucket + 1) & mask;
+        moldTable[bucket] = m->id;
+    }
+}
+
 int EntitySystemManager::getMoldId(const std::vector<uint32_t>& invec)
 {
     auto vec = invec;
@@ -741,28 +2102,29 @@ int EntitySystemManager::getMoldId(const std::vector<uint32_t>& invec)
             return -1;
         }
         lastId = val;
-        auto it = classes.find(val);
-        if (it == classes.end())
+        ComponentClass* cls = getClassBySeq(val);
+        if (cls == nullptr)
         {
             auto* ctx = asGetActiveContext();
             if (ctx)
                 ctx->SetException("EntitySystemManager::getMoldId must be called with registered component IDs");
             return -1;
         }
-        cv.push_back(it->second.get());
+        cv.push_back(cls);
     }
 
-    uint32_t hash = 5381;
-    for (auto it = vec.begin(); it != vec.end(); it++)
-    {
-        hash = hash * 33;
-        hash += *it;
-    }
-    auto it = moldIdsByHash.find(hash);
-    if (it != moldIdsByHash.end())
+    uint64_t hash = HashComponentIds(vec);
+
+    //Keep the load factor at or below one half
+    if ((entityMolds.size() + 1) * 2 > moldTable.size())
+        growMoldTable();
+
+    size_t mask = moldTable.size() - 1;
+    size_t bucket = hash & mask;
+    while (moldTable[bucket] >= 0)
     {
-        auto* cto = entityMolds[it->second].get();
-        if (vec.size() == cto->componentTypes.size())
+        auto* cto = entityMolds[moldTable[bucket]].get();
+        if (cto->hash == hash && vec.size() == cto->componentTypes.size())
         {
             bool allEq = true;
             for (size_t i = 0; i < vec.size(); i++)
@@ -775,19 +2137,17 @@ int EntitySystemManager::getMoldId(const std::vector<uint32_t>& invec)
             }
             if (allEq)
             {
-                return it->second;
+                return moldTable[bucket];
             }
         }
-        cto->hasCollisions = true;
-        log(EntitySystemManager::Warning, "EntitySystemManager MoldCollision");
+        bucket = (bucket + 1) & mask;
     }
+
     EntityType* et = new EntityType;
     et->componentTypes = std::move(cv);
-    et->hasCollisions = false;
     et->hash = hash;
-
-
-
+    et->id = entityMolds.size();
+    moldTable[bucket] = et->id;
 
     entityMolds.push_back(std::unique_ptr<EntityType>(et));
 
@@ -822,23 +2182,28 @@ int EntitySystemManager::getMoldId(const std::vector<uint32_t>& invec)
     }
 
 
+    //Precalculate component slots
+
+    et->slotByClass.resize(classes.size(), -1);
+    for (unsigned int i = 0; i < et->componentTypes.size(); i++)
+        et->slotByClass[et->componentTypes[i]->index] = i;
+
+
     //Precalculate event handlers
 
+    et->eventHandlers.resize(eventCount);
     for (unsigned int i = 0; i < et->componentTypes.size(); i++)
     {
         auto* c = et->componentTypes[i];
         for (unsigned int j = 0; j < c->eventHandlers.size(); j++)
         {
             auto& p = c->eventHandlers[j];
-            et->eventHandlers[p.first].push_back({ i, j });
+            et->eventHandlers[p.event].push_back({ i, j });
         }
     }
 
 
 
-    auto index = entityMolds.size() - 1;
-    moldIdsByHash[hash] = index;
-
     return entityMolds.size() - 1;
 }
 
@@ -865,14 +2230,28 @@ void EntitySystemManager::initEntityClasses(CScriptBuilder* builder)
 {
     asIScriptModule* mod = builder->GetModule();
     unsigned int cnt = mod->GetObjectTypeCount();
+    size_t firstNewClass = classes.size();
     for (unsigned int a = 0; a < cnt; ++a)
     {
         asITypeInfo* ti = mod->GetObjectTypeByIndex(a);
         unsigned int tid = ti->GetTypeId();
         auto metadata = SplitStringByComma(builder->GetMetadataStringForType(tid));
+        if (IsPresentInList(metadata, "Event"))
+        {
+            CoalesceMode mode = CoalesceNone;
+            if (IsPresentInList(metadata, "Coalesce") || IsPresentInList(metadata, "CoalesceLast"))
+                mode = CoalesceLast;
+            else if (IsPresentInList(metadata, "CoalesceFirst"))
+                mode = CoalesceFirst;
+
+            unsigned int seq = tid & asTYPEID_MASK_SEQNBR;
+            if (seq >= coalesceBySeq.size())
+                coalesceBySeq.resize(seq + 1, CoalesceNone);
+            coalesceBySeq[seq] = mode;
+        }
         if (IsPresentInList(metadata,"Component"))
         {
-            if (classes.find(tid) != classes.end())
+            if (getClassBySeq(tid & asTYPEID_MASK_SEQNBR) != nullptr)
             {
                 log(EntitySystemManager::Warning, "Duplicate ComponentClass TypeId: ", ti->GetName(), " tid ", tid);
                 continue;
@@ -898,15 +2277,19 @@ void EntitySystemManager::initEntityClasses(CScriptBuilder* builder)
                 tid = tid & asTYPEID_MASK_SEQNBR;
 
                 c->id = tid;
-                classes[tid] = std::unique_ptr<ComponentClass>(c);
+                c->index = classes.size();
+                classes.push_back(std::unique_ptr<ComponentClass>(c));
+                if (tid >= classIndexBySeq.size())
+                    classIndexBySeq.resize(tid + 1, -1);
+                classIndexBySeq[tid] = c->index;
                 log(EntitySystemManager::Info, "ComponentClass: ", ti->GetName(), " ", tid);
                 
             }
         }
     }
-    for (auto& pair : classes)
+    for (size_t ci = firstNewClass; ci < classes.size(); ci++)
     {
-        auto* cls = pair.second.get();
+        auto* cls = classes[ci].get();
         auto* ti = cls->typeInfo;
         std::string className = ti->GetName();
         while (ti)
@@ -919,6 +2302,10 @@ void EntitySystemManager::initEntityClasses(CScriptBuilder* builder)
                 auto func = ti->GetMethodByIndex(i);
                 const char* name = func->GetName();
                 auto metadata = SplitStringByComma(builder->GetMetadataStringForTypeMethod(ctid, func));
+
+                //A custom copy would not be run by the prototype cloning
+                if (strcmp(name, "opAssign") == 0 && func->GetFuncType() == asFUNC_SCRIPT)
+                    cls->plainData = false;
                 
                 if (IsPresentInList(metadata, "EventHandler"))
                 {
@@ -946,7 +2333,21 @@ void EntitySystemManager::initEntityClasses(CScriptBuilder* builder)
                     }
                     auto seqtid = typeId & asTYPEID_MASK_SEQNBR;
                     func->AddRef();
-                    cls->eventHandlers.push_back({ seqtid, func });
+                    ComponentEventHandler h;
+                    h.event = registerEvent(seqtid);
+                    h.function = func;
+                    h.parallelSafe = IsPresentInList(metadata, "ParallelSafe");
+
+                    std::string every;
+                    if (GetValueFromList(metadata, "Every", every))
+                    {
+                        int n = atoi(every.c_str());
+                        if (n >= 1)
+                            h.every = (unsigned int)n;
+                        else
+                            log(EntitySystemManager::Warning, "Invalid Every value for EventHandler: ", className, "::", name, ", ", every);
+                    }
+                    cls->eventHandlers.push_back(h);
                 }
 
                 if (IsPresentInList(metadata, "InitHandler"))
@@ -965,7 +2366,10 @@ void EntitySystemManager::initEntityClasses(CScriptBuilder* builder)
 
                     
                     func->AddRef();
-                    cls->eventHandlers.push_back({ EntityEventInitId , func });
+                    ComponentEventHandler h;
+                    h.event = EntityEventInitId;
+                    h.function = func;
+                    cls->eventHandlers.push_back(h);
                 }
 
                 if (IsPresentInList(metadata, "DeinitHandler"))
@@ -984,7 +2388,10 @@ void EntitySystemManager::initEntityClasses(CScriptBuilder* builder)
 
 
                     func->AddRef();
-                    cls->eventHandlers.push_back({ EntityEventDeinitId , func });
+                    ComponentEventHandler h;
+                    h.event = EntityEventDeinitId;
+                    h.function = func;
+                    cls->eventHandlers.push_back(h);
                 }
             }
 
@@ -999,9 +2406,24 @@ void EntitySystemManager::initEntityClasses(CScriptBuilder* builder)
                 assert(r >= 0);
                 if (r < 0)
                     continue;
+
+                if (isReference || (typeId & (asTYPEID_MASK_OBJECT | asTYPEID_OBJHANDLE)) != 0)
+                {
+                    //Copied handles would be shared with the prototype, only
+                    //the Entity@ entity back reference is rewired for every
+                    //entity. ComponentRefs are rewired only when the mold
+                    //has the referenced component.
+                    bool rewired = !isReference && strcmp(name, "entity") == 0
+                        && typeId == (entityTypeInfo->GetTypeId() | asTYPEID_OBJHANDLE);
+                    if (!rewired)
+                        cls->plainData = false;
+                }
                 
                 if (isReference)
                     continue;
+
+                if (typeId >= asTYPEID_INT8 && typeId <= asTYPEID_DOUBLE)
+                    cls->numericProperties.push_back({ name, typeId, offset });
                 
                 if (cls->entityReference.has == false && strcmp(name, "entity") == 0)
                 {
@@ -1023,8 +2445,7 @@ void EntitySystemManager::initEntityClasses(CScriptBuilder* builder)
                         continue;
                     }
                     auto reflesstid = typeId & asTYPEID_MASK_SEQNBR;
-                    auto it = classes.find(reflesstid);
-                    if (it == classes.end())
+                    if (getClassBySeq(reflesstid) == nullptr)
                     {
                         log(EntitySystemManager::Warning, "Invalid ComponentRef: ", className, "::", name);
                         continue;
@@ -1048,40 +2469,129 @@ void EntitySystemManager::release()
 {
     if (entityTypeInfo)
         entityTypeInfo->Release();
+    if (entityArrayTypeInfo)
+        entityArrayTypeInfo->Release();
+    if (floatArrayTypeInfo)
+        floatArrayTypeInfo->Release();
     system = nullptr;
     entityTypeInfo = nullptr;
+    entityArrayTypeInfo = nullptr;
+    floatArrayTypeInfo = nullptr;
     classes.clear();
+    classIndexBySeq.clear();
+    eventIndexBySeq.clear();
+    coalesceBySeq.clear();
+    moldQueries.clear();
+    eventCount = 2;
     engine->Release();
 }
 
-EntityType * EntitySystemManager::getTypeByMoldId(unsigned int i)
+unsigned int EntitySystemManager::registerEvent(unsigned int seq)
 {
-    if (i >= entityMolds.size())
-        return nullptr;
-    return entityMolds[i].get();
+    if (seq >= eventIndexBySeq.size())
+        eventIndexBySeq.resize(seq + 1, -1);
+    if (eventIndexBySeq[seq] < 0)
+    {
+        eventIndexBySeq[seq] = eventCount;
+        ++eventCount;
+    }
+    return eventIndexBySeq[seq];
 }
 
-ComponentClass::ComponentClass(const char * name, asIScriptFunction * constructor, asITypeInfo * typeInfo)
+std::shared_ptr<MoldQuery> EntitySystemManager::getMoldQuery(asITypeInfo * queryType)
 {
-    this->name = name;
-    this->factory = constructor;
-    this->typeInfo = typeInfo;
+    auto& q = moldQueries[queryType];
 
-    factory->AddRef();
-    typeInfo->AddRef();
-}
+    asUINT count = queryType->GetSubTypeCount();
+    bool same = q && q->seqs.size() == count;
+    for (asUINT i = 0; same && i < count; ++i)
+        same = q->seqs[i] == (unsigned int) (queryType->GetSubTypeId(i) & asTYPEID_MASK_SEQNBR);
 
-ComponentClass::~ComponentClass()
-{
-    factory->Release();
-    typeInfo->Release();
-    for (auto& p : eventHandlers)
+    if (!same)
     {
-        p.second->Release();
+        q.reset(new MoldQuery());
+        for (asUINT i = 0; i < count; ++i)
+            q->seqs.push_back(queryType->GetSubTypeId(i) & asTYPEID_MASK_SEQNBR);
     }
+
+    updateMoldQuery(q.get());
+    return q;
 }
 
-Component::Component(ComponentClass * cls, Entity * owner)
+void EntitySystemManager::updateMoldQuery(MoldQuery * q)
+{
+    if (q->classes.size() < q->seqs.size())
+    {
+        //Classes may still be registered by a later module
+        for (unsigned int seq : q->seqs)
+        {
+            ComponentClass* cls = getClassBySeq(seq);
+            if (cls == nullptr)
+            {
+                q->classes.clear();
+                return;
+            }
+            q->classes.push_back(cls->index);
+        }
+    }
+
+    for (; q->scannedMolds < entityMolds.size(); ++q->scannedMolds)
+    {
+        const EntityType* et = entityMolds[q->scannedMolds].get();
+        bool match = true;
+        for (unsigned int index : q->classes)
+        {
+            if (index >= et->slotByClass.size() || et->slotByClass[index] < 0)
+            {
+                match = false;
+                break;
+            }
+        }
+        if (match)
+            q->molds.push_back(et->id);
+    }
+}
+
+EntityType * EntitySystemManager::getTypeByMoldId(unsigned int i)
+{
+    if (i >= entityMolds.size())
+        return nullptr;
+    return entityMolds[i].get();
+}
+
+ComponentClass::ComponentClass(const char * name, asIScriptFunction * constructor, asITypeInfo * typeInfo)
+{
+    this->name = name;
+    this->factory = constructor;
+    this->typeInfo = typeInfo;
+
+    factory->AddRef();
+    typeInfo->AddRef();
+}
+
+ComponentClass::~ComponentClass()
+{
+    if (prototype)
+        prototype->Release();
+    factory->Release();
+    typeInfo->Release();
+    for (auto& p : eventHandlers)
+    {
+        p.function->Release();
+    }
+}
+
+const NumericProperty * ComponentClass::findNumericProperty(const char * name) const
+{
+    for (auto& p : numericProperties)
+    {
+        if (p.name == name)
+            return &p;
+    }
+    return nullptr;
+}
+
+Component::Component(ComponentClass * cls, Entity * owner)
     : componentClass(cls), entity(owner)
 {
 
@@ -1112,400 +2622,2871 @@ Component::~Component()
     }
 }
 
-Component * Entity::getComponent(int tid)
+EventWorkerPool::EventWorkerPool(asIScriptEngine * eng, unsigned int threadCount)
+    : engine(eng), nextTask(0)
 {
-    for (Component& c : components)
-    {
-        if (static_cast<int>(c.componentClass->id) == tid)
-            return &c;
-    }
-    return nullptr;
+    for (unsigned int i = 0; i < threadCount; i++)
+        threads.push_back(std::thread(&EventWorkerPool::workerMain, this));
 }
 
-bool Entity::getComponentObject(void * ptr, int tid)
+EventWorkerPool::~EventWorkerPool()
 {
-    if ((tid & asTYPEID_OBJHANDLE) == 0)
-    {
-        auto* ctx = asGetActiveContext();
-        ctx->SetException("Entity::getComponent must be called with a handle to a component type");
-        return false;
-    }
-    
-    tid = tid & asTYPEID_MASK_SEQNBR;
-    Component* c = getComponent(tid);
-    if (c)
     {
-        if (c->object)
-        {
-            c->object->AddRef();
-            *static_cast<asIScriptObject**>(ptr) = c->object;
-            return true;
-        }
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
     }
-    return false;
+    wakeCv.notify_all();
+    for (auto& t : threads)
+        t.join();
 }
 
-unsigned int Entity::sendSpecialEventNowInContext(int seid, asIScriptContext* ctx)
+void EventWorkerPool::workerMain()
 {
-    auto f = type->eventHandlers.find(seid);
-    if (f == type->eventHandlers.end())
-        return 0;
-    else
+    asIScriptContext* ctx = engine->RequestContext();
+
+    size_t seenBatch = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
     {
+        wakeCv.wait(lock, [&] { return quit || batch != seenBatch; });
+        if (quit)
+            break;
+        seenBatch = batch;
 
-        unsigned int cnt = 0;
-        for (auto& p : f->second)
-        {
-            auto& c = components[p.componentIndex];
+        lock.unlock();
+        runTasks(ctx);
+        lock.lock();
 
-            auto* obj = c.object;
-            if (obj == nullptr)
-                continue;
-            auto* func = c.componentClass->eventHandlers[p.eventIndex].second;
-            ctx->Prepare(func);
-            ctx->SetObject(obj);
-            ctx->Execute();
-            ++cnt;
-        }
-        return cnt;
+        --busyWorkers;
+        if (busyWorkers == 0)
+            doneCv.notify_all();
     }
+    lock.unlock();
+
+    engine->ReturnContext(ctx);
+    asThreadCleanup();
 }
 
-unsigned int Entity::sendEventNowInContext(asIScriptObject * ptr, int tid, asIScriptContext * ctx)
+void EventWorkerPool::runTasks(asIScriptContext * ctx)
 {
-    auto p = tid & asTYPEID_MASK_SEQNBR;
-    auto f = type->eventHandlers.find(p);
-    if (f == type->eventHandlers.end())
-        return 0;
-    else
-    {
+    //Commands deferred by a task merge in task order, whichever thread
+    //happened to run it
+    uint64_t threadKey = DeferredCommandKey;
+    uint64_t batchKey = WorkerCommandKeyBase | ((uint64_t)(batch & 0x7FFFFFFF) << 32);
 
-        unsigned int cnt = 0;
-        for (auto& p : f->second)
+    size_t i;
+    while ((i = nextTask.fetch_add(1)) < tasks->size())
+    {
+        DeferredCommandKey = batchKey | (uint32_t)i;
+        const Task& t = (*tasks)[i];
+        for (size_t row = 0; row < t.count; ++row)
         {
-            auto& c = components[p.componentIndex];
-
-            auto* obj = c.object;
+            auto* obj = t.objects[row];
             if (obj == nullptr)
                 continue;
-            auto* func = c.componentClass->eventHandlers[p.eventIndex].second;
-            ctx->Prepare(func);
+            if ((t.tags[row] & t.mask) != t.mask)
+                continue;
+            if (t.every > 1 && t.entities[row]->getStagger(t.slot) % t.every != t.phase)
+                continue;
+
+            ctx->Prepare(t.handler);
             ctx->SetObject(obj);
-            ctx->SetArgAddress(0, ptr);
+            ctx->SetArgAddress(0, event);
             ctx->Execute();
-            ++cnt;
         }
-        return cnt;
     }
-    return 0;
+    DeferredCommandKey = threadKey;
 }
 
-unsigned int Entity::sendEventNow(asIScriptObject * ptr, int tid)
+void EventWorkerPool::dispatch(const std::vector<Task>& t, asIScriptObject * ev, asIScriptContext * ctx)
 {
-
-    if ((tid & asTYPEID_SCRIPTOBJECT) == 0 || (tid & asTYPEID_OBJHANDLE) != 0)
     {
-        auto* ctx = asGetActiveContext();
-        if (ctx)
-        {
-            ctx->SetException("Entity::sendEventNow called with illegal arguments");
-            return 0;
-        }
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks = &t;
+        event = ev;
+        nextTask = 0;
+        busyWorkers = threads.size();
+        ++batch;
     }
-    
+    wakeCv.notify_all();
 
-    auto* ctx = system->engine->RequestContext();
-    auto retval = sendEventNowInContext(ptr, tid, ctx);
-    system->engine->ReturnContext(ctx);
-    return retval;
+    runTasks(ctx);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    doneCv.wait(lock, [&] { return busyWorkers == 0; });
 }
 
-ComponentIterator::ComponentIterator(EntitySystem * sys, VecType * vec)
+size_t EntitySlab::componentsOffset()
 {
-    system = sys;
-    if (vec != nullptr && vec->size() > 0 )
-    {
-        vecIterator = vec->begin();
-        vecEnd = vec->end();
+    size_t align = alignof(Component);
+    return (sizeof(Entity) + align - 1) / align * align;
+}
+
+EntitySlab::EntitySlab(size_t cc, size_t perBlock)
+    : componentCount(cc), slotsPerBlock(perBlock)
+{
+    size_t align = alignof(std::max_align_t);
+    size_t size = componentsOffset() + componentCount * sizeof(Component);
+    slotSize = (size + align - 1) / align * align;
+}
 
-        while ((*vecIterator)->dead)
+Entity * EntitySlab::allocate()
+{
+    void* slot;
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        if (freeList == nullptr)
         {
-            ++vecIterator;
-            if (vecIterator == vecEnd)
+            char* block = new char[slotSize * slotsPerBlock];
+            blocks.push_back(std::unique_ptr<char[]>(block));
+
+            //thread the new slots to the free list, first slot on top
+            for (size_t i = slotsPerBlock; i > 0; i--)
             {
-                finished = true;
-                break;;
+                void* s = block + (i - 1) * slotSize;
+                *static_cast<void**>(s) = freeList;
+                freeList = s;
             }
         }
+
+        slot = freeList;
+        freeList = *static_cast<void**>(slot);
+        ++used;
     }
-    else
-        finished = true;
+
+    Entity* e = new (slot) Entity();
+    Component* first = reinterpret_cast<Component*>(static_cast<char*>(slot) + componentsOffset());
+    for (size_t i = 0; i < componentCount; i++)
+    {
+        new (first + i) Component();
+        first[i].entity = e;
+    }
+    e->components = ComponentSpan(first, componentCount);
+    e->slab = this;
+    return e;
 }
 
-asIScriptObject * ComponentIterator::next()
+void EntitySlab::deallocate(Entity * e)
 {
-    if (finished)
+    bool last;
     {
-        if (invalidated)
-        {
-            asIScriptContext* ctx = asGetActiveContext();
-            ctx->SetException("ComponentIterator invalidated");
-        }
-        return nullptr;
+        std::lock_guard<std::mutex> lk(mutex);
+        void* slot = e;
+        *static_cast<void**>(slot) = freeList;
+        freeList = slot;
+        --used;
+        last = orphaned && used == 0;
     }
-    
-    asIScriptObject* o = (*vecIterator)->object;
-    if (o)
-        o->AddRef();
 
-    do 
+    if (last)
+        delete this;
+}
+
+void EntitySlab::orphan()
+{
+    bool last;
     {
-        ++vecIterator;
-        if (vecIterator == vecEnd)
-        {
-            finished = true;
-            break;
-        }
-    } while ((*vecIterator)->dead);
-    return o;
+        std::lock_guard<std::mutex> lk(mutex);
+        orphaned = true;
+        last = used == 0;
+    }
+
+    if (last)
+        delete this;
 }
 
-void ComponentIterator::release()
+void Entity::destroy()
 {
-    system->releaseComponentIterator(this);
+    EntitySlab* s = slab;
+    for (Component& c : components)
+        c.~Component();
+    this->~Entity();
+    s->deallocate(this);
 }
 
-EntityIterator::EntityIterator(EntitySystem * sys, VecType * vec)
+void DeferredCommandBuffer::push(Command * c)
 {
-    system = sys;
-    if (vec != nullptr && vec->size() > 0)
-    {
-        vecIterator = vec->begin();
-        vecEnd = vec->end();
+    c->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(c->next, c, std::memory_order_release, std::memory_order_relaxed))
+        ;
+}
 
-        while ((*vecIterator)->dead)
-        {
-            ++vecIterator;
-            if (vecIterator == vecEnd)
-            {
-                finished = true;
-                break;;
-            }
-        }
+DeferredCommandBuffer::Command * DeferredCommandBuffer::takeAll()
+{
+    Command* c = head.exchange(nullptr, std::memory_order_acquire);
+
+    //The list is pushed in reverse
+    Command* ordered = nullptr;
+    while (c)
+    {
+        Command* next = c->next;
+        c->next = ordered;
+        ordered = c;
+        c = next;
     }
-    else
-        finished = true;
+    return ordered;
 }
 
-Entity* EntityIterator::next()
+void EventTimerWheel::place(const Timer & t)
 {
-    if (finished)
+    uint64_t delta = t.due - tick;
+    uint64_t slotDue = t.due;
+
+    //Too far away, park it in the last slot reached before the wheel
+    //wraps around and place it again when that slot is cascaded
+    const uint64_t range = (uint64_t) 1 << (SlotBits * Levels);
+    if (delta >= range)
+        slotDue = tick + range - 1;
+
+    unsigned int level = 0;
+    while (level + 1 < Levels && (slotDue - tick) >= ((uint64_t) 1 << (SlotBits * (level + 1))))
+        ++level;
+
+    slots[level][(slotDue >> (SlotBits * level)) & (Slots - 1)].push_back(t);
+}
+
+void EventTimerWheel::schedule(const Timer & t, unsigned int ticks)
+{
+    Timer timer = t;
+    timer.due = tick + (ticks > 0 ? ticks : 1);
+    place(timer);
+    ++count;
+}
+
+void EventTimerWheel::advance(std::vector<Timer>& out)
+{
+    ++tick;
+
+    //Cascade the higher levels whose slot just came up, highest first so
+    //that the timers move all the way down during this tick
+    unsigned int cascade = 0;
+    while (cascade + 1 < Levels && (tick & (((uint64_t) 1 << (SlotBits * (cascade + 1))) - 1)) == 0)
+        ++cascade;
+
+    std::vector<Timer> moved;
+    for (unsigned int level = cascade; level > 0; --level)
     {
-        if (invalidated)
-        {
-            asIScriptContext* ctx = asGetActiveContext();
-            ctx->SetException("EntityIterator invalidated");
-        }
-        return nullptr;
+        auto& slot = slots[level][(tick >> (SlotBits * level)) & (Slots - 1)];
+        if (slot.empty())
+            continue;
+        moved.swap(slot);
+        for (auto& t : moved)
+            place(t);
+        moved.clear();
     }
 
-    Entity* o = (*vecIterator);
-    
-    o->addRef();
+    auto& due = slots[0][tick & (Slots - 1)];
+    count -= due.size();
+    out.insert(out.end(), due.begin(), due.end());
+    due.clear();
+}
 
-    do
+void EventTimerWheel::clear(std::vector<Timer>& out)
+{
+    for (auto& level : slots)
     {
-        ++vecIterator;
-        if (vecIterator == vecEnd)
+        for (auto& slot : level)
         {
-            finished = true;
-            break;
+            out.insert(out.end(), slot.begin(), slot.end());
+            slot.clear();
         }
-    } while ((*vecIterator)->dead);
-    return o;
+    }
+    count = 0;
 }
 
-void EntityIterator::release()
+//Cell coordinates are clamped to 21 bits, three of them make a key
+static const int SpatialCoordLimit = 1 << 20;
+
+int SpatialGrid::cellCoord(float v) const
 {
-    system->releaseEntityIterator(this);
+    float c = std::floor(v * invCellSize);
+    //NaN fails every comparison and ends up in the first cell
+    if (!(c > (float)-SpatialCoordLimit))
+        return -SpatialCoordLimit;
+    if (c >= (float)(SpatialCoordLimit - 1))
+        return SpatialCoordLimit - 1;
+    return (int)c;
 }
 
+uint64_t SpatialGrid::cellKey(int cx, int cy, int cz)
+{
+    return ((uint64_t)(cx + SpatialCoordLimit) << 42)
+        | ((uint64_t)(cy + SpatialCoordLimit) << 21)
+        | (uint64_t)(cz + SpatialCoordLimit);
 }
 
-/* Tests for the above
- 
--- UNIT TESTS -- AngelScript -- Coroutine
+void SpatialGrid::insert(uint64_t key, const Item & item)
+{
+    auto& cell = cells[key];
+    item.entity->spatialCell = key;
+    item.entity->spatialRow = cell.size();
+    item.entity->positioned = true;
+    cell.push_back(item);
+}
 
-namespace ECSTests
+void SpatialGrid::set(Entity * e, float x, float y, float z)
 {
-    class TestEvent
+    uint64_t key = cellKey(cellCoord(x), cellCoord(y), cellCoord(z));
+    if (e->positioned)
     {
-        int value = 0;
+        if (e->spatialCell == key)
+        {
+            Item& item = cells[key][e->spatialRow];
+            item.x = x;
+            item.y = y;
+            item.z = z;
+            return;
+        }
+        remove(e);
     }
-    
-    [Component]
-    class TestComponent_2
+    ++count;
+    insert(key, { e, x, y, z });
+}
+
+void SpatialGrid::remove(Entity * e)
+{
+    if (!e->positioned)
+        return;
+    auto it = cells.find(e->spatialCell);
+    assert(it != cells.end());
+    auto& cell = it->second;
+    cell[e->spatialRow] = cell.back();
+    cell[e->spatialRow].entity->spatialRow = e->spatialRow;
+    cell.pop_back();
+    if (cell.empty())
+        cells.erase(it);
+    e->positioned = false;
+    --count;
+}
+
+void SpatialGrid::setCellSize(float size)
+{
+    if (!(size > 0.0f) || size == cellSize)
+        return;
+
+    std::vector<Item> items;
+    items.reserve(count);
+    for (auto& c : cells)
+        items.insert(items.end(), c.second.begin(), c.second.end());
+    cells.clear();
+
+    cellSize = size;
+    invCellSize = 1.0f / size;
+    for (auto& item : items)
+        insert(cellKey(cellCoord(item.x), cellCoord(item.y), cellCoord(item.z)), item);
+}
+
+template<class F>
+void SpatialGrid::forEachInBox(float minX, float minY, float minZ, float maxX, float maxY, float maxZ, F f) const
+{
+    int x0 = cellCoord(minX), x1 = cellCoord(maxX);
+    int y0 = cellCoord(minY), y1 = cellCoord(maxY);
+    int z0 = cellCoord(minZ), z1 = cellCoord(maxZ);
+    if (x0 > x1 || y0 > y1 || z0 > z1)
+        return;
+
+    //Boxes covering more cells than are occupied visit the occupied ones
+    uint64_t span = (uint64_t)(x1 - x0 + 1) * (uint64_t)(y1 - y0 + 1) * (uint64_t)(z1 - z0 + 1);
+    if (span > cells.size())
     {
-        Entity@ entity;
+        for (auto& c : cells)
+        {
+            for (const Item& item : c.second)
+                f(item);
+        }
+        return;
     }
 
-    [Component]
-    class TestComponent
+    for (int cz = z0; cz <= z1; cz++)
     {
-        Entity@ entity;
-        bool initCalled = false;
-        bool deInitCalled = false;
-        int value = 0;
-
-        [InitHandler]
-        void init()
+        for (int cy = y0; cy <= y1; cy++)
         {
-            initCalled = true;
+            for (int cx = x0; cx <= x1; cx++)
+            {
+                auto it = cells.find(cellKey(cx, cy, cz));
+                if (it == cells.end())
+                    continue;
+                for (const Item& item : it->second)
+                    f(item);
+            }
         }
+    }
+}
 
-        [DeinitHandler]
-        void deinit()
-        {
-            deInitCalled = true;
-        }
+void SpatialGrid::queryBox(float minX, float minY, float minZ, float maxX, float maxY, float maxZ, std::vector<Entity*>& out) const
+{
+    forEachInBox(minX, minY, minZ, maxX, maxY, maxZ, [&](const Item& item) {
+        if (item.x >= minX && item.x <= maxX && item.y >= minY && item.y <= maxY && item.z >= minZ && item.z <= maxZ)
+            out.push_back(item.entity);
+    });
+}
 
+void SpatialGrid::queryRadius(float x, float y, float z, float radius, std::vector<Entity*>& out) const
+{
+    float r2 = radius * radius;
+    forEachInBox(x - radius, y - radius, z - radius, x + radius, y + radius, z + radius, [&](const Item& item) {
+        float dx = item.x - x;
+        float dy = item.y - y;
+        float dz = item.z - z;
+        if (dx * dx + dy * dy + dz * dz <= r2)
+            out.push_back(item.entity);
+    });
+}
 
-        [EventHandler]
-        void update(const TestEvent&in ev)
+void SpatialGrid::clear()
+{
+    for (auto& c : cells)
+    {
+        for (auto& item : c.second)
+            item.entity->positioned = false;
+    }
+    cells.clear();
+    count = 0;
+}
+
+EntityArchetype::EntityArchetype(const EntityType * t, size_t cap)
+    : type(t), chunkCapacity(cap)
+{
+
+}
+
+void EntityArchetype::add(Entity * e)
+{
+    EntityChunk* chunk = e->chunk;
+    size_t row = e->chunkRow;
+    if (chunk == nullptr)
+    {
+        if (chunks.size() == 0 || chunks.back()->count == chunkCapacity)
         {
-            value = ev.value;
+            if (spareChunk)
+                chunks.push_back(std::move(spareChunk));
+            else
+                chunks.push_back(std::unique_ptr<EntityChunk>(
+                    new EntityChunk(type->componentTypes.size(), chunkCapacity)));
+            ++version;
         }
+        chunk = chunks.back().get();
+        row = chunk->count;
+        ++chunk->count;
 
+        chunk->entities[row] = e;
+        e->chunk = chunk;
+        e->chunkRow = row;
     }
+    chunk->tags[row] = e->tags;
 
-    EntityMold@ EM_Test = {
-        ComponentInfo<TestComponent>().getId()
-    };
-    
-    
-    EntityMold@ EM_Test_2 = {
-        ComponentInfo<TestComponent>().getId(),
-        ComponentInfo<TestComponent_2>().getId()
-    };
+    for (size_t i = 0; i < e->components.size(); i++)
+        chunk->column(i)[row] = e->components[i].object;
+}
 
-    [Test]
-    void ComponentTest()
-    {
-        TestComponent@ tc;
-        Entity@ e = ESM::ConstructEntity(EM_Test);
+void EntityArchetype::remove(Entity * e)
+{
+    EntityChunk* chunk = e->chunk;
+    size_t row = e->chunkRow;
+    size_t slots = type->componentTypes.size();
 
-        Assert(e !is null);
+    EntityChunk* last = chunks.back().get();
+    size_t lastRow = last->count - 1;
+    if (last != chunk || lastRow != row)
+    {
+        Entity* moved = last->entities[lastRow];
+        chunk->entities[row] = moved;
+        chunk->tags[row] = last->tags[lastRow];
+        for (size_t i = 0; i < slots; i++)
+            chunk->column(i)[row] = last->column(i)[lastRow];
+        moved->chunk = chunk;
+        moved->chunkRow = row;
+    }
+    last->entities[lastRow] = nullptr;
+    for (size_t i = 0; i < slots; i++)
+        last->column(i)[lastRow] = nullptr;
+    --last->count;
+    e->chunk = nullptr;
 
-        e.getComponent(@tc);
+    if (last->count == 0)
+    {
+        spareChunk = std::move(chunks.back());
+        chunks.pop_back();
+        ++version;
+    }
+}
 
-        Assert(tc !is null);
+void EntityArchetype::detachAll()
+{
+    for (auto& chunk : chunks)
+    {
+        for (size_t r = 0; r < chunk->count; r++)
+            chunk->entities[r]->chunk = nullptr;
+    }
+    chunks.clear();
+    ++version;
+}
 
-        Assert(tc.entity is e);
-        Assert(tc.entity == e);
-        Assert(tc.initCalled == false);
+size_t EntityArchetype::size() const
+{
+    size_t total = 0;
+    for (auto& chunk : chunks)
+        total += chunk->count;
+    return total;
+}
 
-        Assert(e.dead == false);
-        Assert(e.id > 0);
+void Entity::setDormant(bool d)
+{
+    dormantRequested = d;
+    if (!dormancyPending)
+    {
+        dormancyPending = true;
+        addRef();
+        system->dormancyChanges.push_back(this);
+    }
+}
 
-        ESM::UpdateEntityLists();
+void Entity::setTags(uint32_t t)
+{
+    tags = t;
+    if (chunk)
+        chunk->tags[chunkRow] = t;
+}
 
-        Assert(tc.initCalled == true);
+//! Tag bit index check, sets a script exception on failure
+static bool CheckTag(unsigned int tag)
+{
+    if (tag < 32)
+        return true;
+    asIScriptContext* ctx = asGetActiveContext();
+    if (ctx)
+        ctx->SetException("Entity tag out of range");
+    return false;
+}
 
-        ESM::KillEntity(e);
-        Assert(e.dead == false);
-        Assert(e.id > 0);
-        Assert(tc.deInitCalled == false);
+void Entity::setTag(unsigned int tag)
+{
+    if (CheckTag(tag))
+        setTags(tags | (1u << tag));
+}
 
-        ESM::UpdateEntityLists();
-        Assert(e.dead == true);
-        Assert(e.id == 0);
-        Assert(tc.deInitCalled == true);
+void Entity::clearTag(unsigned int tag)
+{
+    if (CheckTag(tag))
+        setTags(tags & ~(1u << tag));
+}
 
-        Assert(tc.entity.dead == true);
+bool Entity::hasTag(unsigned int tag) const
+{
+    if (!CheckTag(tag))
+        return false;
+    return (tags & (1u << tag)) != 0;
+}
 
-        TestComponent@ tc2;
-        e.getComponent(@tc2);
+EntityId Entity::getHandle() const
+{
+    EntityId h;
+    if (slot != 0)
+    {
+        h.index = slot;
+        h.generation = system->entitySlots[slot].generation;
+    }
+    return h;
+}
 
-        Assert(tc2 is null);
+Component * Entity::getComponent(int tid)
+{
+    ComponentClass* cls = system->manager->getClassBySeq(tid);
+    if (cls == nullptr || cls->index >= type->slotByClass.size())
+        return nullptr;
 
-        Assert(e.dead == true);
-        ESM::KillEntity(e);
-        Assert(e.dead == true);
-        ESM::UpdateEntityLists();
-        Assert(e.dead == true);
+    int slot = type->slotByClass[cls->index];
+    if (slot < 0)
+        return nullptr;
+    return &components[slot];
+}
 
+bool Entity::getComponentObject(void * ptr, int tid)
+{
+    if ((tid & asTYPEID_OBJHANDLE) == 0)
+    {
+        auto* ctx = asGetActiveContext();
+        ctx->SetException("Entity::getComponent must be called with a handle to a component type");
+        return false;
     }
     
-    [Test]
-    void EventTest()
+    tid = tid & asTYPEID_MASK_SEQNBR;
+    Component* c = getComponent(tid);
+    if (c)
     {
-        TestComponent@ tc;
-        Entity@ e = ESM::ConstructEntity(EM_Test);
+        if (c->object)
+        {
+            c->object->AddRef();
+            *static_cast<asIScriptObject**>(ptr) = c->object;
+            return true;
+        }
+    }
+    return false;
+}
 
-        Assert(e !is null);
-        e.getComponent(@tc);
-        Assert(tc !is null);
-        Assert(tc.value == 0);
-        
-        ESM::UpdateEntityLists();
-        
-        TestEvent te;
-        te.value = 101;
-        
-        ESM::QueueGlobalEvent(te);
-        ESM::SendEvents();
-        
-        Assert(tc.value == 101);
-        
-        te.value = 66;
-        ESM::QueueLocalEvent(e, te);
-        ESM::SendEvents();
-        
-        Assert(tc.value == 66);
+unsigned int Entity::sendSpecialEventNowInContext(int seid, asIScriptContext* ctx)
+{
+    if (static_cast<size_t>(seid) >= type->eventHandlers.size())
+        return 0;
+    else
+    {
+
+        unsigned int cnt = 0;
+        for (auto& p : type->eventHandlers[seid])
+        {
+            auto& c = components[p.componentIndex];
+
+            auto* obj = c.object;
+            if (obj == nullptr)
+                continue;
+            auto* func = c.componentClass->eventHandlers[p.eventIndex].function;
+            ctx->Prepare(func);
+            ctx->SetObject(obj);
+            ctx->Execute();
+            ++cnt;
+        }
+        return cnt;
     }
+}
 
-    [Test]
-    void IteratorTest()
+unsigned int Entity::sendEventNowInContext(asIScriptObject * ptr, unsigned int event, asIScriptContext * ctx)
+{
+    if (event >= type->eventHandlers.size())
+        return 0;
+    else
     {
-        //Construct ten entities
-        for (uint i = 0; i < 5; i++)
-            ESM::ConstructEntity(EM_Test);
-        
-        for (uint i = 0; i < 5; i++)
-            ESM::ConstructEntity(EM_Test_2);
-        
-        ESM::UpdateEntityLists();
-        
-        //Send event to all of them
-        TestEvent te;
-        te.value = 1;
-        
-        ESM::QueueGlobalEvent(te);
-        ESM::SendEvents();
-        
 
-        //Iterate through all 
-        ComponentIterator<TestComponent> ci;
-        
-        int tc2s = 0;
-        int total = 0;
-        TestComponent@ tc;
-        
-        while ((@tc = ci.next()) !is null)
+        unsigned int cnt = 0;
+        for (auto& p : type->eventHandlers[event])
         {
-            Assert(tc.value == 1);
-            total += tc.value;
-            
-            //Count number of entities with TestComponent_2 in them
-            
-            TestComponent_2@ tc2;
-            tc.entity.getComponent(@tc2);
-            if (tc2 !is null)
-                tc2s += 1;
+            auto& c = components[p.componentIndex];
+
+            auto* obj = c.object;
+            if (obj == nullptr)
+                continue;
+            auto* func = c.componentClass->eventHandlers[p.eventIndex].function;
+            ctx->Prepare(func);
+            ctx->SetObject(obj);
+            ctx->SetArgAddress(0, ptr);
+            ctx->Execute();
+            ++cnt;
         }
-        
-        Assert(total == 10);
-        Assert(tc2s == 5);
+        return cnt;
+    }
+    return 0;
+}
+
+unsigned int Entity::sendEventNow(asIScriptObject * ptr, int tid)
+{
+
+    if ((tid & asTYPEID_SCRIPTOBJECT) == 0 || (tid & asTYPEID_OBJHANDLE) != 0)
+    {
+        auto* ctx = asGetActiveContext();
+        if (ctx)
+        {
+            ctx->SetException("Entity::sendEventNow called with illegal arguments");
+            return 0;
+        }
+    }
+    
+
+    int event = system->manager->getEventIndex(tid & asTYPEID_MASK_SEQNBR);
+    if (event < 0)
+        return 0;
+
+    auto* ctx = system->engine->RequestContext();
+    auto retval = sendEventNowInContext(ptr, event, ctx);
+    system->engine->ReturnContext(ctx);
+    return retval;
+}
+
+ECSIterator::ECSIterator(EntitySystem * sys)
+    : system(sys), epoch(sys->structureEpoch)
+{
+    nextActive = sys->activeIterators;
+    if (nextActive)
+        nextActive->prevActive = this;
+    sys->activeIterators = this;
+}
+
+ECSIterator::~ECSIterator()
+{
+    unlink();
+}
+
+void ECSIterator::unlink()
+{
+    if (system == nullptr)
+        return;
+    if (prevActive)
+        prevActive->nextActive = nextActive;
+    else
+        system->activeIterators = nextActive;
+    if (nextActive)
+        nextActive->prevActive = prevActive;
+}
+
+void ECSIterator::orphan()
+{
+    unlink();
+    system = nullptr;
+    prevActive = nextActive = nullptr;
+    invalidated = true;
+    finished = true;
+}
+
+void ECSIterator::checkEpoch()
+{
+    if (system == nullptr || epoch != system->structureEpoch)
+    {
+        invalidated = true;
+        finished = true;
+    }
+}
+
+ComponentIterator::ComponentIterator(EntitySystem * sys, VecType * vec, uint32_t mask)
+    : ECSIterator(sys), tagMask(mask)
+{
+    columns = vec;
+    if (columns != nullptr)
+        advance();
+    else
+        finished = true;
+}
+
+void ComponentIterator::advance()
+{
+    while (columnIndex < columns->size())
+    {
+        const ArchetypeColumn& col = (*columns)[columnIndex];
+        auto& chunks = col.archetype->chunks;
+        while (chunkIndex < chunks.size())
+        {
+            EntityChunk* chunk = chunks[chunkIndex].get();
+            asIScriptObject** objects = chunk->column(col.slot);
+            const uint32_t* tags = chunk->tags.data();
+            while (row < chunk->count)
+            {
+                asIScriptObject* o = objects[row];
+                uint32_t t = tags[row];
+                ++row;
+                if (o && (t & tagMask) == tagMask)
+                {
+                    current = o;
+                    return;
+                }
+            }
+            row = 0;
+            ++chunkIndex;
+        }
+        chunkIndex = 0;
+        ++columnIndex;
+    }
+    current = nullptr;
+    finished = true;
+}
+
+asIScriptObject * ComponentIterator::next()
+{
+    checkEpoch();
+    if (finished)
+    {
+        if (invalidated)
+        {
+            asIScriptContext* ctx = asGetActiveContext();
+            ctx->SetException("ComponentIterator invalidated");
+        }
+        return nullptr;
+    }
+    
+    asIScriptObject* o = current;
+    o->AddRef();
+
+    advance();
+    return o;
+}
+
+void ComponentIterator::release()
+{
+    if (system)
+        system->releaseComponentIterator(this);
+    else
+    {
+        this->~ComponentIterator();
+        ::operator delete(this);
+    }
+}
+
+SortedComponentIterator::SortedComponentIterator(EntitySystem * sys, std::shared_ptr<const std::vector<asIScriptObject*>> o)
+    : ECSIterator(sys), order(std::move(o))
+{
+    if (order->empty())
+        finished = true;
+}
+
+asIScriptObject * SortedComponentIterator::next()
+{
+    checkEpoch();
+    if (finished)
+    {
+        if (invalidated)
+        {
+            asIScriptContext* ctx = asGetActiveContext();
+            ctx->SetException("SortedComponentIterator invalidated");
+        }
+        return nullptr;
+    }
+
+    asIScriptObject* o = (*order)[index];
+    o->AddRef();
+    if (++index >= order->size())
+        finished = true;
+    return o;
+}
+
+void SortedComponentIterator::release()
+{
+    if (system)
+        system->releaseSortedComponentIterator(this);
+    else
+    {
+        this->~SortedComponentIterator();
+        ::operator delete(this);
+    }
+}
+
+template<class Derived>
+QueryCursor<Derived>::QueryCursor(EntitySystem * sys, const char * message, uint32_t mask)
+    : ECSIterator(sys), tagMask(mask), invalidatedMessage(message)
+{
+
+}
+
+template<class Derived>
+bool QueryCursor<Derived>::advance(asIScriptObject** out)
+{
+    checkEpoch();
+    if (finished)
+    {
+        if (invalidated)
+        {
+            asIScriptContext* ctx = asGetActiveContext();
+            ctx->SetException(invalidatedMessage);
+        }
+        current = nullptr;
+        return false;
+    }
+
+    do
+    {
+        while (chunk && row < chunk->count)
+        {
+            size_t r = row;
+            ++row;
+
+            if ((chunk->tags[r] & tagMask) != tagMask)
+                continue;
+
+            //Columns of dead entities are cleared, a failed component
+            //factory leaves a single null object
+            size_t i = 0;
+            while (i < classCount && chunk->column(slots[i])[r] != nullptr)
+                ++i;
+            if (i < classCount)
+                continue;
+
+            for (i = 0; i < classCount; ++i)
+            {
+                out[i] = chunk->column(slots[i])[r];
+                out[i]->AddRef();
+            }
+            current = chunk->entities[r];
+            return true;
+        }
+        row = 0;
+        chunk = static_cast<Derived*>(this)->nextChunk();
+    } while (chunk);
+
+    current = nullptr;
+    finished = true;
+    return false;
+}
+
+template<class Derived>
+bool QueryCursor<Derived>::next2(asIScriptObject** a, asIScriptObject** b)
+{
+    asIScriptObject* out[MaxComponents];
+    if (!advance(out))
+        return false;
+    *a = out[0];
+    *b = out[1];
+    return true;
+}
+
+template<class Derived>
+bool QueryCursor<Derived>::next3(asIScriptObject** a, asIScriptObject** b, asIScriptObject** c)
+{
+    asIScriptObject* out[MaxComponents];
+    if (!advance(out))
+        return false;
+    *a = out[0];
+    *b = out[1];
+    *c = out[2];
+    return true;
+}
+
+template<class Derived>
+Entity * QueryCursor<Derived>::getEntity()
+{
+    checkEpoch();
+    if (current == nullptr || invalidated)
+        return nullptr;
+    current->addRef();
+    return current;
+}
+
+template class QueryCursor<ComponentQuery>;
+template class QueryCursor<CachedComponentQuery>;
+
+ComponentQuery::ComponentQuery(EntitySystem * sys, const MoldQuery * q, uint32_t mask)
+    : QueryCursor(sys, "Query invalidated", mask), query(q)
+{
+    classCount = query->classes.size();
+    slots = archetypeSlots;
+    if (classCount == 0 || !nextArchetype())
+        finished = true;
+}
+
+bool ComponentQuery::nextArchetype()
+{
+    auto& archetypes = system->archetypes;
+    for (; moldIndex < query->molds.size(); ++moldIndex)
+    {
+        unsigned int mold = query->molds[moldIndex];
+        if (mold >= archetypes.size() || !archetypes[mold])
+            continue;
+
+        archetype = archetypes[mold].get();
+        for (size_t i = 0; i < classCount; ++i)
+            archetypeSlots[i] = archetype->type->slotByClass[query->classes[i]];
+        chunkIndex = 0;
+        return true;
+    }
+    archetype = nullptr;
+    return false;
+}
+
+EntityChunk * ComponentQuery::nextChunk()
+{
+    while (archetype)
+    {
+        if (chunkIndex < archetype->chunks.size())
+            return archetype->chunks[chunkIndex++].get();
+        ++moldIndex;
+        nextArchetype();
+    }
+    return nullptr;
+}
+
+void ComponentQuery::release()
+{
+    if (system)
+        system->releaseQuery(this);
+    else
+    {
+        this->~ComponentQuery();
+        ::operator delete(this);
+    }
+}
+
+CachedComponentQuery::CachedComponentQuery(EntitySystem * sys, asITypeInfo * t, std::shared_ptr<MoldQuery> q, uint32_t mask)
+    : QueryCursor(sys, "CachedQuery invalidated, call reset first", mask), query(std::move(q)), type(t)
+{
+    type->AddRef();
+    reset();
+}
+
+CachedComponentQuery::~CachedComponentQuery()
+{
+    type->Release();
+}
+
+const EntityArchetype * CachedComponentQuery::findArchetype(unsigned int mold) const
+{
+    auto& archetypes = system->archetypes;
+    if (mold >= archetypes.size())
+        return nullptr;
+    return archetypes[mold].get();
+}
+
+bool CachedComponentQuery::isStale() const
+{
+    if (generation != system->archetypeGeneration || seen.size() != query->molds.size())
+        return true;
+
+    for (size_t i = 0; i < seen.size(); ++i)
+    {
+        const EntityArchetype* a = findArchetype(query->molds[i]);
+        if (a != seen[i].first || (a && a->version != seen[i].second))
+            return true;
+    }
+    return false;
+}
+
+void CachedComponentQuery::rebuild()
+{
+    ++system->stat_cachedQueryRebuilds;
+
+    ranges.clear();
+    seen.clear();
+    generation = system->archetypeGeneration;
+
+    for (unsigned int mold : query->molds)
+    {
+        const EntityArchetype* a = findArchetype(mold);
+        seen.push_back(std::make_pair(a, a ? a->version : 0));
+        if (a == nullptr)
+            continue;
+
+        Range range;
+        for (size_t i = 0; i < query->classes.size(); ++i)
+            range.slots[i] = a->type->slotByClass[query->classes[i]];
+        for (auto& chunk : a->chunks)
+        {
+            range.chunk = chunk.get();
+            ranges.push_back(range);
+        }
+    }
+}
+
+void CachedComponentQuery::reset()
+{
+    current = nullptr;
+    if (system == nullptr)
+        return;
+
+    system->manager->updateMoldQuery(query.get());
+    if (isStale())
+        rebuild();
+
+    epoch = system->structureEpoch;
+    classCount = query->classes.size();
+    chunk = nullptr;
+    rangeIndex = 0;
+    row = 0;
+    invalidated = false;
+    finished = classCount == 0;
+}
+
+EntityChunk * CachedComponentQuery::nextChunk()
+{
+    if (rangeIndex >= ranges.size())
+        return nullptr;
+    const Range& range = ranges[rangeIndex++];
+    slots = range.slots;
+    return range.chunk;
+}
+
+void CachedComponentQuery::addRef()
+{
+    ++refCount;
+}
+
+void CachedComponentQuery::release()
+{
+    --refCount;
+    if (refCount == 0)
+        delete this;
+}
+
+EntityIterator::EntityIterator(EntitySystem * sys, VecType * vec, uint32_t mask)
+    : ECSIterator(sys), tagMask(mask)
+{
+    if (vec != nullptr && vec->size() > 0)
+    {
+        vecIterator = vec->begin();
+        vecEnd = vec->end();
+
+        while (skip(*vecIterator))
+        {
+            ++vecIterator;
+            if (vecIterator == vecEnd)
+            {
+                finished = true;
+                break;;
+            }
+        }
+    }
+    else
+        finished = true;
+}
+
+Entity* EntityIterator::next()
+{
+    checkEpoch();
+    if (finished)
+    {
+        if (invalidated)
+        {
+            asIScriptContext* ctx = asGetActiveContext();
+            ctx->SetException("EntityIterator invalidated");
+        }
+        return nullptr;
+    }
+
+    Entity* o = (*vecIterator);
+    
+    o->addRef();
+
+    do
+    {
+        ++vecIterator;
+        if (vecIterator == vecEnd)
+        {
+            finished = true;
+            break;
+        }
+    } while (skip(*vecIterator));
+    return o;
+}
+
+bool EntityIterator::skip(const Entity * e) const
+{
+    return e->dead || e->dormant || (e->getTags() & tagMask) != tagMask;
+}
+
+void EntityIterator::release()
+{
+    if (system)
+        system->releaseEntityIterator(this);
+    else
+    {
+        this->~EntityIterator();
+        ::operator delete(this);
+    }
+}
+
+}
+
+/* Tests for the above
+ 
+-- UNIT TESTS -- AngelScript -- Coroutine
+
+namespace ECSTests
+{
+    class TestEvent
+    {
+        int value = 0;
+    }
+    
+    [Component]
+    class TestComponent_2
+    {
+        Entity@ entity;
+    }
+
+    [Component]
+    class TestComponent
+    {
+        Entity@ entity;
+        bool initCalled = false;
+        bool deInitCalled = false;
+        int value = 0;
+
+        [InitHandler]
+        void init()
+        {
+            initCalled = true;
+        }
+
+        [DeinitHandler]
+        void deinit()
+        {
+            deInitCalled = true;
+        }
+
+
+        [EventHandler]
+        void update(const TestEvent&in ev)
+        {
+            value = ev.value;
+        }
+
+    }
+
+    EntityMold@ EM_Test = {
+        ComponentInfo<TestComponent>().getId()
+    };
+    
+    
+    EntityMold@ EM_Test_2 = {
+        ComponentInfo<TestComponent>().getId(),
+        ComponentInfo<TestComponent_2>().getId()
+    };
+
+    [Test]
+    void ComponentTest()
+    {
+        TestComponent@ tc;
+        Entity@ e = ESM::ConstructEntity(EM_Test);
+
+        Assert(e !is null);
+
+        e.getComponent(@tc);
+
+        Assert(tc !is null);
+
+        Assert(tc.entity is e);
+        Assert(tc.entity == e);
+        Assert(tc.initCalled == false);
+
+        Assert(e.dead == false);
+        Assert(e.id > 0);
+
+        ESM::UpdateEntityLists();
+
+        Assert(tc.initCalled == true);
+
+        ESM::KillEntity(e);
+        Assert(e.dead == false);
+        Assert(e.id > 0);
+        Assert(tc.deInitCalled == false);
+
+        ESM::UpdateEntityLists();
+        Assert(e.dead == true);
+        Assert(e.id == 0);
+        Assert(tc.deInitCalled == true);
+
+        Assert(tc.entity.dead == true);
+
+        TestComponent@ tc2;
+        e.getComponent(@tc2);
+
+        Assert(tc2 is null);
+
+        Assert(e.dead == true);
+        ESM::KillEntity(e);
+        Assert(e.dead == true);
+        ESM::UpdateEntityLists();
+        Assert(e.dead == true);
+
+    }
+    
+    [Test]
+    void EventTest()
+    {
+        TestComponent@ tc;
+        Entity@ e = ESM::ConstructEntity(EM_Test);
+
+        Assert(e !is null);
+        e.getComponent(@tc);
+        Assert(tc !is null);
+        Assert(tc.value == 0);
+        
+        ESM::UpdateEntityLists();
+        
+        TestEvent te;
+        te.value = 101;
+        
+        ESM::QueueGlobalEvent(te);
+        ESM::SendEvents();
+        
+        Assert(tc.value == 101);
+        
+        te.value = 66;
+        ESM::QueueLocalEvent(e, te);
+        ESM::SendEvents();
+        
+        Assert(tc.value == 66);
+    }
+
+    [Test]
+    void IteratorTest()
+    {
+        //Construct ten entities
+        for (uint i = 0; i < 5; i++)
+            ESM::ConstructEntity(EM_Test);
+        
+        for (uint i = 0; i < 5; i++)
+            ESM::ConstructEntity(EM_Test_2);
+        
+        ESM::UpdateEntityLists();
+        
+        //Send event to all of them
+        TestEvent te;
+        te.value = 1;
+        
+        ESM::QueueGlobalEvent(te);
+        ESM::SendEvents();
+        
+
+        //Iterate through all 
+        ComponentIterator<TestComponent> ci;
+        
+        int tc2s = 0;
+        int total = 0;
+        TestComponent@ tc;
+        
+        while ((@tc = ci.next()) !is null)
+        {
+            Assert(tc.value == 1);
+            total += tc.value;
+            
+            //Count number of entities with TestComponent_2 in them
+            
+            TestComponent_2@ tc2;
+            tc.entity.getComponent(@tc2);
+            if (tc2 !is null)
+                tc2s += 1;
+        }
+        
+        Assert(total == 10);
+        Assert(tc2s == 5);
+    }
+    
+    [Test]
+    void ChunkCompactionTest()
+    {
+        //Enough entities to span several archetype chunks
+        array<Entity@> entities;
+        for (uint i = 0; i < 1000; i++)
+            entities.insertLast(ESM::ConstructEntity(EM_Test));
+        
+        ESM::UpdateEntityLists();
+        
+        for (uint i = 0; i < entities.length(); i += 3)
+            ESM::KillEntity(entities[i]);
+        
+        ESM::UpdateEntityLists();
+        
+        TestEvent te;
+        te.value = 7;
+        ESM::QueueGlobalEvent(te);
+        ESM::SendEvents();
+        
+        ComponentIterator<TestComponent> ci;
+        TestComponent@ tc;
+        int total = 0;
+        while ((@tc = ci.next()) !is null)
+        {
+            Assert(tc.value == 7);
+            Assert(tc.entity.dead == false);
+            total += 1;
+        }
+        
+        Assert(total == 666);
+    }
+    
+    [Test]
+    void RecycleTest()
+    {
+        for (uint i = 0; i < 10; i++)
+        {
+            Entity@ e = ESM::ConstructEntity(EM_Test_2);
+            TestComponent@ tc;
+            e.getComponent(@tc);
+            tc.value = 10;
+        }
+        ESM::UpdateEntityLists();
+        ESM::KillAllEntities();
+        ESM::UpdateEntityLists();
+        
+        //The dead entities may be recycled, but must look brand new
+        for (uint i = 0; i < 10; i++)
+        {
+            Entity@ e = ESM::ConstructEntity(EM_Test_2);
+            Assert(e.dead == false);
+            Assert(e.id > 0);
+            
+            TestComponent@ tc;
+            e.getComponent(@tc);
+            Assert(tc !is null);
+            Assert(tc.entity is e);
+            Assert(tc.value == 0);
+            Assert(tc.initCalled == false);
+        }
+        ESM::UpdateEntityLists();
+        
+        int total = 0;
+        ComponentIterator<TestComponent_2> ci;
+        while (ci.next() !is null)
+            total += 1;
+        Assert(total == 10);
+    }
+    
+    [Test]
+    void EntityIdTest()
+    {
+        EntityId none;
+        Assert(none.get() is null);
+        Assert(none.alive == false);
+        
+        array<EntityId> handles;
+        for (uint i = 0; i < 4; i++)
+            handles.insertLast(ESM::ConstructEntity(EM_Test).handle);
+        
+        //Valid already before spawning
+        Assert(handles[0].alive);
+        Assert(!(handles[0] == handles[1]));
+        
+        ESM::UpdateEntityLists();
+        
+        Entity@ e = handles[2].get();
+        Assert(e !is null);
+        Assert(e.handle == handles[2]);
+        
+        ESM::KillEntity(e);
+        ESM::UpdateEntityLists();
+        
+        Assert(e.dead);
+        Assert(handles[2].get() is null);
+        Assert(handles[2].alive == false);
+        Assert(handles[0].get() !is null);
+        
+        //A new entity may get the slot but never the generation
+        Entity@ e2 = ESM::ConstructEntity(EM_Test);
+        Assert(handles[2].get() is null);
+        Assert(e2.handle.get() is e2);
+    }
+    
+    [Component]
+    class ParallelComponent
+    {
+        int value = 0;
+        
+        [EventHandler, ParallelSafe]
+        void update(const TestEvent&in ev)
+        {
+            value += ev.value;
+        }
+    }
+    
+    [Test]
+    void ParallelSafeEventTest()
+    {
+        ESM::SetWorkerThreads(4);
+        Assert(ESM::GetWorkerThreads() == 4);
+        
+        EntityMold@ EM = {
+            ComponentInfo<ParallelComponent>().getId(),
+            ComponentInfo<TestComponent>().getId()
+        };
+        
+        for (uint i = 0; i < 600; i++)
+            ESM::ConstructEntity(EM);
+        ESM::UpdateEntityLists();
+        
+        TestEvent te;
+        te.value = 3;
+        ESM::QueueGlobalEvent(te);
+        ESM::QueueGlobalEvent(te);
+        ESM::SendEvents();
+        
+        int total = 0;
+        ComponentIterator<ParallelComponent> ci;
+        ParallelComponent@ pc;
+        while ((@pc = ci.next()) !is null)
+        {
+            Assert(pc.value == 6);
+            total += 1;
+        }
+        Assert(total == 600);
+        
+        //Serial handlers of the same event still ran
+        ComponentIterator<TestComponent> ti;
+        TestComponent@ tc;
+        while ((@tc = ti.next()) !is null)
+            Assert(tc.value == 3);
+        
+        ESM::SetWorkerThreads(0);
+    }
+    
+    //Handlers of a mold mixing serial and parallel handlers
+    int HandlerOrderStep = 0;
+    
+    [Component]
+    class HandlerOrderFirst
+    {
+        [EventHandler]
+        void update(const TestEvent&in ev)
+        {
+            HandlerOrderStep++;
+        }
+    }
+    
+    [Component]
+    class HandlerOrderParallel
+    {
+        int seenStep = -1;
+        
+        //Only reads the counter, the serial handlers are not running
+        [EventHandler, ParallelSafe]
+        void update(const TestEvent&in ev)
+        {
+            seenStep = HandlerOrderStep;
+        }
+    }
+    
+    [Component]
+    class HandlerOrderLast
+    {
+        [EventHandler]
+        void update(const TestEvent&in ev)
+        {
+            HandlerOrderStep++;
+        }
+    }
+    
+    [Test]
+    void ParallelSafeHandlerOrderTest()
+    {
+        ESM::SetWorkerThreads(2);
+        HandlerOrderStep = 0;
+        
+        EntityMold@ EM = {
+            ComponentInfo<HandlerOrderFirst>().getId(),
+            ComponentInfo<HandlerOrderParallel>().getId(),
+            ComponentInfo<HandlerOrderLast>().getId()
+        };
+        Entity@ e = ESM::ConstructEntity(EM);
+        ESM::UpdateEntityLists();
+        
+        TestEvent te;
+        ESM::QueueGlobalEvent(te);
+        ESM::SendEvents();
+        
+        //The parallel handler ran between the serial ones
+        HandlerOrderParallel@ hp;
+        e.getComponent(@hp);
+        Assert(hp.seenStep == 1);
+        Assert(HandlerOrderStep == 2);
+        
+        ESM::SetWorkerThreads(0);
+    }
+    
+    [Test]
+    void MoldIdentityTest()
+    {
+        EntityMold@ a = {
+            ComponentInfo<TestComponent>().getId(),
+            ComponentInfo<TestComponent_2>().getId()
+        };
+        EntityMold@ b = {
+            ComponentInfo<TestComponent_2>().getId(),
+            ComponentInfo<TestComponent>().getId()
+        };
+        EntityMold@ c = {
+            ComponentInfo<TestComponent_2>().getId()
+        };
+        
+        //Molds are identified by the exact set of components
+        Assert(a is b);
+        Assert(a is EM_Test_2);
+        Assert(!(a is c));
+        Assert(!(c is EM_Test));
+    }
+    
+    [Test]
+    void IteratorReuseTest()
+    {
+        for (uint i = 0; i < 4; i++)
+            ESM::ConstructEntity(EM_Test);
+        
+        ESM::UpdateEntityLists();
+        
+        //Iterators released by earlier passes are reused
+        for (uint pass = 0; pass < 8; pass++)
+        {
+            ComponentIterator<TestComponent> outer;
+            ComponentIterator<TestComponent> inner;
+            
+            int outerCount = 0;
+            int innerCount = 0;
+            while (outer.next() !is null)
+                outerCount++;
+            while (inner.next() !is null)
+                innerCount++;
+            
+            Assert(outerCount == 4);
+            Assert(innerCount == 4);
+        }
+    }
+    
+    [Test]
+    void QueryTest()
+    {
+        for (uint i = 0; i < 3; i++)
+            ESM::ConstructEntity(EM_Test);
+        
+        for (uint i = 0; i < 4; i++)
+            ESM::ConstructEntity(EM_Test_2);
+        
+        ESM::UpdateEntityLists();
+        
+        //Only the entities with both components are visited
+        Query<TestComponent, TestComponent_2> q;
+        TestComponent@ tc;
+        TestComponent_2@ tc2;
+        
+        int count = 0;
+        while (q.next(tc, tc2))
+        {
+            Assert(tc !is null);
+            Assert(tc2 !is null);
+            Assert(tc.entity is tc2.entity);
+            Assert(q.entity is tc.entity);
+            count++;
+        }
+        
+        Assert(count == 4);
+        Assert(q.entity is null);
+    }
+    
+    [Test]
+    void CachedQueryTest()
+    {
+        for (uint i = 0; i < 2; i++)
+            ESM::ConstructEntity(EM_Test_2);
+        
+        ESM::UpdateEntityLists();
+        
+        CachedQuery<TestComponent, TestComponent_2> q;
+        TestComponent@ tc;
+        TestComponent_2@ tc2;
+        
+        int count = 0;
+        while (q.next(tc, tc2))
+            count++;
+        Assert(count == 2);
+        
+        //Structural changes require a new pass
+        Entity@ e = ESM::ConstructEntity(EM_Test_2);
+        ESM::UpdateEntityLists();
+        
+        q.reset();
+        count = 0;
+        while (q.next(tc, tc2))
+            count++;
+        Assert(count == 3);
+        
+        ESM::KillEntity(e);
+        ESM::UpdateEntityLists();
+        ESM::CleanUp();
+        
+        q.reset();
+        count = 0;
+        while (q.next(tc, tc2))
+        {
+            Assert(q.entity !is e);
+            count++;
+        }
+        Assert(count == 2);
+    }
+    
+    [Event, Coalesce]
+    class DirtyEvent
+    {
+        int value = 0;
+    }
+    
+    [Event, CoalesceFirst]
+    class FirstDirtyEvent
+    {
+        int value = 0;
+    }
+    
+    [Component]
+    class CoalesceComponent
+    {
+        int calls = 0;
+        int value = 0;
+        
+        [EventHandler]
+        void dirty(const DirtyEvent&in ev)
+        {
+            calls++;
+            value = ev.value;
+        }
+        
+        [EventHandler]
+        void firstDirty(const FirstDirtyEvent&in ev)
+        {
+            calls++;
+            value = ev.value;
+        }
+    }
+    
+    [Test]
+    void CoalesceEventTest()
+    {
+        EntityMold@ EM = {
+            ComponentInfo<CoalesceComponent>().getId()
+        };
+        
+        Entity@ e = ESM::ConstructEntity(EM);
+        ESM::UpdateEntityLists();
+        
+        CoalesceComponent@ cc;
+        e.getComponent(@cc);
+        
+        //Only the last queued instance is delivered
+        for (int i = 1; i <= 40; i++)
+        {
+            DirtyEvent de;
+            de.value = i;
+            ESM::QueueLocalEvent(e, de);
+        }
+        ESM::SendEvents();
+        Assert(cc.calls == 1);
+        Assert(cc.value == 40);
+        
+        for (int i = 1; i <= 5; i++)
+        {
+            DirtyEvent de;
+            de.value = i;
+            ESM::QueueGlobalEvent(de);
+        }
+        ESM::SendEvents();
+        Assert(cc.calls == 2);
+        Assert(cc.value == 5);
+        
+        //Or only the first
+        for (int i = 1; i <= 5; i++)
+        {
+            FirstDirtyEvent fe;
+            fe.value = i;
+            ESM::QueueLocalEvent(e, fe);
+        }
+        ESM::SendEvents();
+        Assert(cc.calls == 3);
+        Assert(cc.value == 1);
+    }
+    
+    [Test]
+    void TaggedCoalesceEventTest()
+    {
+        EntityMold@ EM = {
+            ComponentInfo<CoalesceComponent>().getId()
+        };
+        
+        Entity@ enemy = ESM::ConstructEntity(EM);
+        Entity@ player = ESM::ConstructEntity(EM);
+        enemy.setTag(0);
+        player.setTag(1);
+        ESM::UpdateEntityLists();
+        
+        CoalesceComponent@ ec;
+        enemy.getComponent(@ec);
+        CoalesceComponent@ pc;
+        player.getComponent(@pc);
+        
+        //Events for different tag sets are never merged
+        DirtyEvent de;
+        de.value = 1;
+        ESM::QueueGlobalEvent(de, 1 << 0);
+        de.value = 2;
+        ESM::QueueGlobalEvent(de, 1 << 0);
+        de.value = 3;
+        ESM::QueueGlobalEvent(de, 1 << 1);
+        ESM::SendEvents();
+        Assert(ec.calls == 1);
+        Assert(ec.value == 2);
+        Assert(pc.calls == 1);
+        Assert(pc.value == 3);
+        
+        FirstDirtyEvent fe;
+        fe.value = 4;
+        ESM::QueueGlobalEvent(fe, 1 << 0);
+        fe.value = 5;
+        ESM::QueueGlobalEvent(fe, 1 << 1);
+        ESM::SendEvents();
+        Assert(ec.calls == 2);
+        Assert(ec.value == 4);
+        Assert(pc.calls == 2);
+        Assert(pc.value == 5);
+    }
+    
+    [Test]
+    void DelayedEventTest()
+    {
+        Entity@ e = ESM::ConstructEntity(EM_Test);
+        Entity@ doomed = ESM::ConstructEntity(EM_Test);
+        ESM::UpdateEntityLists();
+        
+        TestComponent@ tc;
+        e.getComponent(@tc);
+        TestComponent@ doomedTc;
+        doomed.getComponent(@doomedTc);
+        
+        TestEvent te;
+        te.value = 7;
+        ESM::QueueLocalEventAfter(e, te, 3);
+        ESM::QueueLocalEventAfter(doomed, te, 2);
+        
+        TestEvent ge;
+        ge.value = 9;
+        ESM::QueueGlobalEventAfter(ge, 5);
+        
+        ESM::KillEntity(doomed);
+        ESM::UpdateEntityLists();
+        
+        //Delivered by the third SendEvents call
+        ESM::SendEvents();
+        ESM::SendEvents();
+        Assert(tc.value == 0);
+        ESM::SendEvents();
+        Assert(tc.value == 7);
+        Assert(doomedTc.value == 0);
+        
+        ESM::SendEvents();
+        Assert(tc.value == 7);
+        ESM::SendEvents();
+        Assert(tc.value == 9);
+    }
+    
+    void deferSpawns()
+    {
+        for (uint i = 0; i < 50; i++)
+            ESM::DeferConstructEntity(EM_Test);
+    }
+    
+    [Test]
+    void DeferredCommandTest()
+    {
+        Thread@[] threads;
+        for (uint i = 0; i < 4; i++)
+        {
+            Thread@ t = Thread::CreateThread(@deferSpawns);
+            threads.insertLast(@t);
+            Assert(t.run());
+        }
+        for (uint i = 0; i < threads.length(); i++)
+            Assert(threads[i].wait(10000) != 0);
+        
+        //Nothing happens before the commands are merged
+        ComponentIterator<TestComponent> before;
+        Assert(before.next() is null);
+        
+        ESM::UpdateEntityLists();
+        
+        int count = 0;
+        ComponentIterator<TestComponent> ci;
+        TestComponent@ tc;
+        TestComponent@ it;
+        while ((@it = ci.next()) !is null)
+        {
+            Assert(it.initCalled);
+            @tc = it;
+            count++;
+        }
+        Assert(count == 200);
+        
+        TestEvent te;
+        te.value = 4;
+        ESM::DeferLocalEvent(tc.entity, te);
+        ESM::DeferKillEntity(tc.entity);
+        ESM::SendEvents();
+        Assert(tc.value == 4);
+        
+        ESM::UpdateEntityLists();
+        Assert(tc.deInitCalled);
+    }
+    
+    void deferSpawnsLate()
+    {
+        ESM::SetDeferredCommandIndex(2);
+        for (uint i = 0; i < 20; i++)
+            ESM::DeferConstructEntity(EM_Test_2);
+    }
+    
+    void deferSpawnsEarly()
+    {
+        ESM::SetDeferredCommandIndex(1);
+        for (uint i = 0; i < 20; i++)
+            ESM::DeferConstructEntity(EM_Test);
+    }
+    
+    [Test]
+    void DeferredCommandOrderTest()
+    {
+        //The higher index defers first, but is merged last
+        Thread@ late = Thread::CreateThread(@deferSpawnsLate);
+        Assert(late.run());
+        Assert(late.wait(10000) != 0);
+        Thread@ early = Thread::CreateThread(@deferSpawnsEarly);
+        Assert(early.run());
+        Assert(early.wait(10000) != 0);
+        
+        ESM::UpdateEntityLists();
+        
+        uint lastEarly = 0;
+        uint firstLate = 0xFFFFFFFF;
+        int count = 0;
+        ComponentIterator<TestComponent> ci;
+        TestComponent@ tc;
+        while ((@tc = ci.next()) !is null)
+        {
+            TestComponent_2@ tc2;
+            uint id = tc.entity.id;
+            if (tc.entity.getComponent(@tc2))
+            {
+                if (id < firstLate)
+                    firstLate = id;
+            }
+            else if (id > lastEarly)
+                lastEarly = id;
+            count++;
+        }
+        Assert(count == 40);
+        Assert(lastEarly < firstLate);
+    }
+    
+    const uint TAG_ENEMY = 0;
+    const uint TAG_VISIBLE = 1;
+    
+    [Test]
+    void TagTest()
+    {
+        Entity@[] entities;
+        for (uint i = 0; i < 6; i++)
+            entities.insertLast(ESM::ConstructEntity(EM_Test));
+        
+        entities[0].setTag(TAG_ENEMY);
+        ESM::UpdateEntityLists();
+        
+        entities[1].setTag(TAG_ENEMY);
+        entities[1].setTag(TAG_VISIBLE);
+        entities[2].setTag(TAG_ENEMY);
+        entities[2].clearTag(TAG_ENEMY);
+        entities[3].tags = (1 << TAG_ENEMY) | (1 << TAG_VISIBLE);
+        
+        Assert(entities[0].hasTag(TAG_ENEMY));
+        Assert(!entities[0].hasTag(TAG_VISIBLE));
+        Assert(!entities[2].hasTag(TAG_ENEMY));
+        
+        int count = 0;
+        ComponentIterator<TestComponent> ci(1 << TAG_ENEMY);
+        TestComponent@ tc;
+        while ((@tc = ci.next()) !is null)
+        {
+            Assert(tc.entity.hasTag(TAG_ENEMY));
+            count++;
+        }
+        Assert(count == 3);
+        
+        //Only the visible enemies receive the event
+        TestEvent te;
+        te.value = 5;
+        ESM::QueueGlobalEvent(te, (1 << TAG_ENEMY) | (1 << TAG_VISIBLE));
+        ESM::SendEvents();
+        
+        for (uint i = 0; i < entities.length(); i++)
+        {
+            entities[i].getComponent(@tc);
+            Assert(tc.value == ((i == 1 || i == 3) ? 5 : 0));
+        }
+    }
+    
+    [Test]
+    void TaggedQueryTest()
+    {
+        Entity@[] entities;
+        for (uint i = 0; i < 4; i++)
+            entities.insertLast(ESM::ConstructEntity(EM_Test_2));
+        ESM::UpdateEntityLists();
+        
+        entities[1].setTag(TAG_ENEMY);
+        entities[3].setTag(TAG_ENEMY);
+        
+        TestComponent@ tc;
+        TestComponent_2@ tc2;
+        
+        int count = 0;
+        Query<TestComponent, TestComponent_2> q(1 << TAG_ENEMY);
+        while (q.next(tc, tc2))
+        {
+            Assert(q.entity.hasTag(TAG_ENEMY));
+            count++;
+        }
+        Assert(count == 2);
+        
+        CachedQuery<TestComponent, TestComponent_2> cq(1 << TAG_ENEMY);
+        count = 0;
+        while (cq.next(tc, tc2))
+            count++;
+        Assert(count == 2);
+        
+        //The mask is read on every pass
+        entities[0].setTag(TAG_ENEMY);
+        cq.reset();
+        count = 0;
+        while (cq.next(tc, tc2))
+            count++;
+        Assert(count == 3);
+    }
+    
+    int plainConstructions = 0;
+    
+    [Component]
+    class PlainComponent
+    {
+        Entity@ entity;
+        int hp = 100;
+        float speed = 2.5f;
+        
+        PlainComponent()
+        {
+            plainConstructions++;
+        }
+    }
+    
+    [Test]
+    void PrototypeCloningTest()
+    {
+        EntityMold@ EM = {
+            ComponentInfo<PlainComponent>().getId(),
+            ComponentInfo<TestComponent>().getId()
+        };
+        EM.prototypeCloning = true;
+        Assert(EM.prototypeCloning);
+        
+        int before = plainConstructions;
+        Entity@[] entities;
+        for (uint i = 0; i < 10; i++)
+            entities.insertLast(ESM::ConstructEntity(EM));
+        
+        //At most the prototype itself was constructed
+        Assert(plainConstructions - before <= 1);
+        
+        ESM::UpdateEntityLists();
+        for (uint i = 0; i < entities.length(); i++)
+        {
+            PlainComponent@ pc;
+            entities[i].getComponent(@pc);
+            Assert(pc !is null);
+            Assert(pc.entity is entities[i]);
+            Assert(pc.hp == 100);
+            Assert(pc.speed == 2.5f);
+            pc.hp = i;
+            
+            TestComponent@ tc;
+            entities[i].getComponent(@tc);
+            Assert(tc.initCalled);
+        }
+        
+        PlainComponent@ first;
+        entities[0].getComponent(@first);
+        Assert(first.hp == 0);
+    }
+    
+    int handleConstructions = 0;
+    
+    //Neither handle is rewired, so copying the prototype would share them
+    [Component]
+    class HandleMemberComponent
+    {
+        PlainComponent@ entity;
+        [ComponentRef]
+        TestComponent@ test;
+        
+        HandleMemberComponent()
+        {
+            handleConstructions++;
+        }
+    }
+    
+    [Test]
+    void PrototypeCloningHandleTest()
+    {
+        EntityMold@ EM = {
+            ComponentInfo<HandleMemberComponent>().getId()
+        };
+        EM.prototypeCloning = true;
+        
+        int before = handleConstructions;
+        for (uint i = 0; i < 5; i++)
+            ESM::ConstructEntity(EM);
+        
+        //Every entity ran the constructor
+        Assert(handleConstructions - before == 5);
+    }
+    
+    [Test]
+    void BulkConstructionTest()
+    {
+        array<Entity@>@ entities = ESM::ConstructEntities(EM_Test_2, 50);
+        Assert(entities.length() == 50);
+        ESM::SpawnEntities(EM_Test, 25);
+        
+        ESM::UpdateEntityLists();
+        
+        for (uint i = 0; i < entities.length(); i++)
+        {
+            Assert(!entities[i].dead);
+            TestComponent@ tc;
+            entities[i].getComponent(@tc);
+            Assert(tc.entity is entities[i]);
+            Assert(tc.initCalled);
+        }
+        
+        int count = 0;
+        ComponentIterator<TestComponent> ci;
+        while (ci.next() !is null)
+            count++;
+        Assert(count == 75);
+        
+        Assert(ESM::ConstructEntities(EM_Test, 0).length() == 0);
+    }
+    
+    [Test]
+    void DormantEntityTest()
+    {
+        Entity@ sleeper = ESM::ConstructEntity(EM_Test);
+        Entity@ awake = ESM::ConstructEntity(EM_Test);
+        
+        //Requests before the spawn are applied by the same update
+        sleeper.setDormant(true);
+        Assert(!sleeper.dormant);
+        ESM::UpdateEntityLists();
+        Assert(sleeper.dormant);
+        Assert(!sleeper.dead);
+        
+        TestComponent@ sleeperTc;
+        sleeper.getComponent(@sleeperTc);
+        Assert(sleeperTc.initCalled);
+        
+        TestEvent te;
+        te.value = 2;
+        ESM::QueueGlobalEvent(te);
+        ESM::SendEvents();
+        Assert(sleeperTc.value == 0);
+        
+        int count = 0;
+        ComponentIterator<TestComponent> ci;
+        while (ci.next() !is null)
+            count++;
+        Assert(count == 1);
+        
+        //Local events still reach dormant entities
+        te.value = 3;
+        ESM::QueueLocalEvent(sleeper, te);
+        ESM::SendEvents();
+        Assert(sleeperTc.value == 3);
+        
+        sleeper.setDormant(false);
+        ESM::UpdateEntityLists();
+        Assert(!sleeper.dormant);
+        
+        te.value = 4;
+        ESM::QueueGlobalEvent(te);
+        ESM::SendEvents();
+        Assert(sleeperTc.value == 4);
+        
+        //Dormant entities die normally
+        sleeper.setDormant(true);
+        ESM::UpdateEntityLists();
+        ESM::KillEntity(sleeper);
+        ESM::UpdateEntityLists();
+        Assert(sleeper.dead);
+        Assert(sleeperTc.deInitCalled);
+    }
+    
+    [Event]
+    class StaggeredEvent
+    {
+    }
+    
+    [Component]
+    class StaggeredComponent
+    {
+        int calls = 0;
+        
+        [EventHandler, Every = 4]
+        void update(const StaggeredEvent&in ev)
+        {
+            calls += 1;
+        }
+    }
+    
+    [Test]
+    void StaggeredEventHandlerTest()
+    {
+        EntityMold@ EM = {
+            ComponentInfo<StaggeredComponent>().getId()
+        };
+        
+        for (uint i = 0; i < 8; i++)
+            ESM::ConstructEntity(EM);
+        ESM::UpdateEntityLists();
+        
+        StaggeredEvent ev;
+        ESM::QueueGlobalEvent(ev);
+        ESM::SendEvents();
+        
+        //A quarter of the components per send
+        int reached = 0;
+        ComponentIterator<StaggeredComponent> ci;
+        StaggeredComponent@ sc;
+        while ((@sc = ci.next()) !is null)
+            reached += sc.calls;
+        Assert(reached == 2);
+        
+        //Every component once per four sends
+        for (uint i = 0; i < 3; i++)
+        {
+            ESM::QueueGlobalEvent(ev);
+            ESM::SendEvents();
+        }
+        ComponentIterator<StaggeredComponent> ci2;
+        while ((@sc = ci2.next()) !is null)
+            Assert(sc.calls == 1);
+    }
+    
+    [Test]
+    void StaggeredEventHandlerStrideTest()
+    {
+        EntityMold@ EM = {
+            ComponentInfo<StaggeredComponent>().getId()
+        };
+        
+        //Entity ids of the staggered components are four apart
+        for (uint i = 0; i < 8; i++)
+        {
+            ESM::ConstructEntity(EM);
+            ESM::SpawnEntities(EM_Test, 3);
+        }
+        ESM::UpdateEntityLists();
+        
+        StaggeredEvent ev;
+        ESM::QueueGlobalEvent(ev);
+        ESM::SendEvents();
+        
+        //Still spread evenly instead of all on the same send
+        int reached = 0;
+        ComponentIterator<StaggeredComponent> ci;
+        StaggeredComponent@ sc;
+        while ((@sc = ci.next()) !is null)
+            reached += sc.calls;
+        Assert(reached == 2);
+    }
+    
+    [Test]
+    void SpatialQueryTest()
+    {
+        ESM::SetSpatialCellSize(4);
+        array<Entity@>@ entities = ESM::ConstructEntities(EM_Test, 10);
+        for (uint i = 0; i < entities.length(); i++)
+            ESM::SetPosition(entities[i], float(i) * 3, 0);
+        ESM::UpdateEntityLists();
+        
+        //Positions 0, 3 and 6
+        array<Entity@>@ near = ESM::QueryRadius(3, 0, 0, 3);
+        Assert(near.length() == 3);
+        Assert(ESM::QueryBox(2, -1, -1, 10, 1, 1).length() == 3);
+        
+        //Moving across cells and changing the cell size keep the index
+        ESM::SetPosition(entities[9], 1, 1);
+        ESM::SetSpatialCellSize(32);
+        Assert(ESM::QueryRadius(0, 0, 0, 2).length() == 2);
+        
+        ESM::RemovePosition(entities[0]);
+        Assert(ESM::QueryRadius(0, 0, 0, 2).length() == 1);
+        
+        //Killed entities leave the index
+        ESM::KillEntity(entities[9]);
+        ESM::UpdateEntityLists();
+        Assert(ESM::QueryRadius(0, 0, 0, 2).length() == 0);
+        Assert(ESM::QueryBox(-100, -100, -100, 100, 100, 100).length() == 8);
+        
+        ESM::SetSpatialCellSize(16);
+    }
+    
+    [Component]
+    class GatherComponent
+    {
+        float x = 1.5f;
+        int count = 2;
+    }
+    
+    [Test]
+    void GatherScatterTest()
+    {
+        uint id = ComponentInfo<GatherComponent>().getId();
+        EntityMold@ EM = {
+            id,
+            ComponentInfo<TestComponent>().getId()
+        };
+        
+        ESM::SpawnEntities(EM, 20);
+        ESM::UpdateEntityLists();
+        
+        array<float>@ xs = ESM::GatherFloat(id, "x");
+        Assert(xs.length() == 20);
+        for (uint i = 0; i < xs.length(); i++)
+        {
+            Assert(xs[i] == 1.5f);
+            xs[i] = float(i);
+        }
+        ESM::ScatterFloat(id, "x", xs);
+        
+        //Same order as the component iteration
+        ComponentIterator<GatherComponent> ci;
+        GatherComponent@ gc;
+        uint i = 0;
+        while ((@gc = ci.next()) !is null)
+        {
+            Assert(gc.x == float(i));
+            Assert(gc.count == 2);
+            i++;
+        }
+        Assert(i == 20);
+    }
+    
+    [Component]
+    class DepthComponent
+    {
+        float depth = 0;
+        int priority = 0;
+    }
+    
+    [Test]
+    void SortedComponentIteratorTest()
+    {
+        EntityMold@ EM = {
+            ComponentInfo<DepthComponent>().getId()
+        };
+        ESM::SpawnEntities(EM, 40);
+        ESM::UpdateEntityLists();
+        
+        int n = 0;
+        ComponentIterator<DepthComponent> ci;
+        DepthComponent@ dc;
+        while ((@dc = ci.next()) !is null)
+        {
+            dc.depth = float((n * 17) % 40) - 20.5f;
+            dc.priority = 40 - n;
+            n++;
+        }
+        
+        //Radix sorted on the first use
+        float last = -1000;
+        n = 0;
+        SortedComponentIterator<DepthComponent> si("depth");
+        while ((@dc = si.next()) !is null)
+        {
+            Assert(dc.depth >= last);
+            last = dc.depth;
+            n++;
+        }
+        Assert(n == 40);
+        
+        //A changed value is moved in the previous order
+        SortedComponentIterator<DepthComponent> first("depth");
+        @dc = first.next();
+        dc.depth = 100;
+        SortedComponentIterator<DepthComponent> si2("depth");
+        last = -1000;
+        DepthComponent@ lastComponent;
+        while ((@dc = si2.next()) !is null)
+        {
+            Assert(dc.depth >= last);
+            last = dc.depth;
+            @lastComponent = dc;
+        }
+        Assert(lastComponent.depth == 100);
+        
+        //Integer properties work the same
+        int lastPriority = -1;
+        SortedComponentIterator<DepthComponent> pi("priority");
+        while ((@dc = pi.next()) !is null)
+        {
+            Assert(dc.priority > lastPriority);
+            lastPriority = dc.priority;
+        }
+        Assert(lastPriority == 40);
+        
+        //Integers too large for a float keep their exact order, float keys
+        //would tie neighbours and keep them in the descending spawn order
+        n = 0;
+        ComponentIterator<DepthComponent> ci2;
+        while ((@dc = ci2.next()) !is null)
+        {
+            dc.priority = (n % 2 == 0) ? 16777257 - n : 16777216 - n;
+            n++;
+        }
+        int64 lastLarge = -1;
+        SortedComponentIterator<DepthComponent> li("priority");
+        while ((@dc = li.next()) !is null)
+        {
+            Assert(dc.priority > lastLarge);
+            lastLarge = dc.priority;
+        }
+        Assert(lastLarge == 16777257);
+    }
+    
+    [Test]
+    void SortCacheAcrossFramesTest()
+    {
+        EntityMold@ EM = {
+            ComponentInfo<DepthComponent>().getId()
+        };
+        ESM::SpawnEntities(EM, 30);
+        ESM::UpdateEntityLists();
+        
+        int n = 0;
+        ComponentIterator<DepthComponent> ci;
+        DepthComponent@ dc;
+        while ((@dc = ci.next()) !is null)
+        {
+            dc.depth = float(30 - n);
+            n++;
+        }
+        
+        {
+            SortedComponentIterator<DepthComponent> si("depth");
+        }
+        uint radixSorts = ESM::GetRadixSorts();
+        Assert(radixSorts > 0);
+        
+        //A frame without spawns or kills keeps the previous order
+        ESM::UpdateEntityLists();
+        ComponentIterator<DepthComponent> ci2;
+        @dc = ci2.next();
+        dc.depth = 0.5f;
+        
+        SortedComponentIterator<DepthComponent> si2("depth");
+        @dc = si2.next();
+        Assert(dc.depth == 0.5f);
+        Assert(ESM::GetRadixSorts() == radixSorts);
+        
+        //Spawning into the class sorts it again
+        ESM::SpawnEntities(EM, 1);
+        ESM::UpdateEntityLists();
+        SortedComponentIterator<DepthComponent> si3("depth");
+        Assert(ESM::GetRadixSorts() == radixSorts + 1);
+    }
+    
+    //Benchmarks are run only by the test runner's --bench option. They time
+    //the measured loop themselves and report the cost of a single operation.
+    
+    [Event]
+    class BenchEvent
+    {
+        int value = 1;
+    }
+    
+    [Component]
+    class BenchHandlerA
+    {
+        int sum = 0;
+        
+        [EventHandler]
+        void handle(const BenchEvent&in ev)
+        {
+            sum += ev.value;
+        }
+    }
+    
+    [Component]
+    class BenchHandlerB
+    {
+        int sum = 0;
+        
+        [EventHandler]
+        void handle(const BenchEvent&in ev)
+        {
+            sum += ev.value;
+        }
+    }
+    
+    //Component classes for the mold size benchmarks
+    [Component]
+    class MoldBench0
+    {
+        int value = 0;
+    }
+    
+    [Component]
+    class MoldBench1
+    {
+        int value = 1;
+    }
+    
+    [Component]
+    class MoldBench2
+    {
+        int value = 2;
+    }
+    
+    [Component]
+    class MoldBench3
+    {
+        int value = 3;
+    }
+    
+    [Component]
+    class MoldBench4
+    {
+        int value = 4;
+    }
+    
+    [Component]
+    class MoldBench5
+    {
+        int value = 5;
+    }
+    
+    [Component]
+    class MoldBench6
+    {
+        int value = 6;
+    }
+    
+    [Component]
+    class MoldBench7
+    {
+        int value = 7;
+    }
+    
+    [Component]
+    class MoldBench8
+    {
+        int value = 8;
+    }
+    
+    [Component]
+    class MoldBench9
+    {
+        int value = 9;
+    }
+    
+    [Component]
+    class MoldBench10
+    {
+        int value = 10;
+    }
+    
+    [Component]
+    class MoldBench11
+    {
+        int value = 11;
+    }
+    
+    [Component]
+    class MoldBench12
+    {
+        int value = 12;
+    }
+    
+    [Component]
+    class MoldBench13
+    {
+        int value = 13;
+    }
+    
+    [Component]
+    class MoldBench14
+    {
+        int value = 14;
+    }
+    
+    [Component]
+    class MoldBench15
+    {
+        int value = 15;
+    }
+    
+    [Component]
+    class MoldBench16
+    {
+        int value = 16;
+    }
+    
+    [Component]
+    class MoldBench17
+    {
+        int value = 17;
+    }
+    
+    [Component]
+    class MoldBench18
+    {
+        int value = 18;
+    }
+    
+    [Component]
+    class MoldBench19
+    {
+        int value = 19;
+    }
+    
+    [Component]
+    class MoldBench20
+    {
+        int value = 20;
+    }
+    
+    [Component]
+    class MoldBench21
+    {
+        int value = 21;
+    }
+    
+    [Component]
+    class MoldBench22
+    {
+        int value = 22;
+    }
+    
+    [Component]
+    class MoldBench23
+    {
+        int value = 23;
+    }
+    
+    [Component]
+    class MoldBench24
+    {
+        int value = 24;
+    }
+    
+    [Component]
+    class MoldBench25
+    {
+        int value = 25;
+    }
+    
+    [Component]
+    class MoldBench26
+    {
+        int value = 26;
+    }
+    
+    [Component]
+    class MoldBench27
+    {
+        int value = 27;
+    }
+    
+    [Component]
+    class MoldBench28
+    {
+        int value = 28;
+    }
+    
+    [Component]
+    class MoldBench29
+    {
+        int value = 29;
+    }
+    
+    [Component]
+    class MoldBench30
+    {
+        int value = 30;
+    }
+    
+    [Component]
+    class MoldBench31
+    {
+        int value = 31;
+    }
+    
+    //Ids of the first count MoldBench classes
+    array<uint>@ MoldBenchIds(uint count)
+    {
+        array<uint> ids = {
+            ComponentInfo<MoldBench0>().getId(),
+            ComponentInfo<MoldBench1>().getId(),
+            ComponentInfo<MoldBench2>().getId(),
+            ComponentInfo<MoldBench3>().getId(),
+            ComponentInfo<MoldBench4>().getId(),
+            ComponentInfo<MoldBench5>().getId(),
+            ComponentInfo<MoldBench6>().getId(),
+            ComponentInfo<MoldBench7>().getId(),
+            ComponentInfo<MoldBench8>().getId(),
+            ComponentInfo<MoldBench9>().getId(),
+            ComponentInfo<MoldBench10>().getId(),
+            ComponentInfo<MoldBench11>().getId(),
+            ComponentInfo<MoldBench12>().getId(),
+            ComponentInfo<MoldBench13>().getId(),
+            ComponentInfo<MoldBench14>().getId(),
+            ComponentInfo<MoldBench15>().getId(),
+            ComponentInfo<MoldBench16>().getId(),
+            ComponentInfo<MoldBench17>().getId(),
+            ComponentInfo<MoldBench18>().getId(),
+            ComponentInfo<MoldBench19>().getId(),
+            ComponentInfo<MoldBench20>().getId(),
+            ComponentInfo<MoldBench21>().getId(),
+            ComponentInfo<MoldBench22>().getId(),
+            ComponentInfo<MoldBench23>().getId(),
+            ComponentInfo<MoldBench24>().getId(),
+            ComponentInfo<MoldBench25>().getId(),
+            ComponentInfo<MoldBench26>().getId(),
+            ComponentInfo<MoldBench27>().getId(),
+            ComponentInfo<MoldBench28>().getId(),
+            ComponentInfo<MoldBench29>().getId(),
+            ComponentInfo<MoldBench30>().getId(),
+            ComponentInfo<MoldBench31>().getId()
+        };
+        ids.resize(count);
+        return ids;
+    }
+    
+    //Spawns count entities round robin over the molds
+    array<Entity@>@ SpawnBenchEntities(const array<EntityMold@>&in molds, uint count)
+    {
+        array<Entity@> entities;
+        for (uint i = 0; i < count; i++)
+            entities.insertLast(ESM::ConstructEntity(molds[i % molds.length()]));
+        ESM::UpdateEntityLists();
+        return entities;
+    }
+    
+    const uint DispatchBenchEntities = 2000;
+    const uint DispatchBenchRounds = 50;
+    
+    //Sends the global BenchEvent to entities spread over the molds and
+    //reports the time per handler call
+    void RunDispatchBenchmark(const string &in name, const array<EntityMold@>&in molds)
+    {
+        array<Entity@>@ entities = SpawnBenchEntities(molds, DispatchBenchEntities);
+        
+        BenchEvent ev;
+        double start = BenchmarkTime();
+        for (uint r = 0; r < DispatchBenchRounds; r++)
+        {
+            ESM::QueueGlobalEvent(ev);
+            ESM::SendEvents();
+        }
+        //BenchHandlerA and BenchHandlerB on every entity
+        ReportBenchmark(name, BenchmarkTime() - start, DispatchBenchRounds * DispatchBenchEntities * 2);
+        
+        BenchHandlerA@ a;
+        entities[0].getComponent(@a);
+        Assert(a.sum == int(DispatchBenchRounds));
+    }
+    
+    //BenchHandlerA and BenchHandlerB, plus the first extra MoldBench classes
+    //one at a time for distinct molds
+    array<EntityMold@>@ DispatchBenchMolds(uint molds)
+    {
+        array<uint>@ extra = MoldBenchIds(molds);
+        array<EntityMold@> result;
+        for (uint i = 0; i < molds; i++)
+        {
+            array<uint> ids = {
+                ComponentInfo<BenchHandlerA>().getId(),
+                ComponentInfo<BenchHandlerB>().getId(),
+                extra[i]
+            };
+            result.insertLast(ESM::GetMold(ids));
+        }
+        return result;
+    }
+    
+    //Every entity in a single mold, each handler runs once over all of them
+    [Benchmark]
+    void DispatchBenchmarkGrouped()
+    {
+        RunDispatchBenchmark("DispatchBenchmarkGrouped", DispatchBenchMolds(1));
+    }
+    
+    //Consecutive entities in different molds, the handlers alternate
+    //between eight archetypes
+    [Benchmark]
+    void DispatchBenchmarkInterleaved()
+    {
+        RunDispatchBenchmark("DispatchBenchmarkInterleaved", DispatchBenchMolds(8));
+    }
+    
+    const uint GetComponentBenchLookups = 200000;
+    
+    //Entity of a mold with the first count MoldBench classes
+    Entity@ GetComponentBenchEntity(uint count)
+    {
+        array<EntityMold@> molds = { ESM::GetMold(MoldBenchIds(count)) };
+        return SpawnBenchEntities(molds, 1)[0];
+    }
+    
+    //Each looks up the last component of the mold, the worst case of a scan
+    [Benchmark]
+    void GetComponentBenchmark2()
+    {
+        Entity@ e = GetComponentBenchEntity(2);
+        MoldBench1@ c;
+        double start = BenchmarkTime();
+        for (uint i = 0; i < GetComponentBenchLookups; i++)
+            e.getComponent(@c);
+        ReportBenchmark("GetComponentBenchmark2", BenchmarkTime() - start, GetComponentBenchLookups);
+        Assert(c.value == 1);
+    }
+    
+    [Benchmark]
+    void GetComponentBenchmark8()
+    {
+        Entity@ e = GetComponentBenchEntity(8);
+        MoldBench7@ c;
+        double start = BenchmarkTime();
+        for (uint i = 0; i < GetComponentBenchLookups; i++)
+            e.getComponent(@c);
+        ReportBenchmark("GetComponentBenchmark8", BenchmarkTime() - start, GetComponentBenchLookups);
+        Assert(c.value == 7);
+    }
+    
+    [Benchmark]
+    void GetComponentBenchmark32()
+    {
+        Entity@ e = GetComponentBenchEntity(32);
+        MoldBench31@ c;
+        double start = BenchmarkTime();
+        for (uint i = 0; i < GetComponentBenchLookups; i++)
+            e.getComponent(@c);
+        ReportBenchmark("GetComponentBenchmark32", BenchmarkTime() - start, GetComponentBenchLookups);
+        Assert(c.value == 31);
+    }
+    
+    const uint MoldBenchMolds = 10000;
+    
+    //Component ids of the subset of classes given by the bits of m
+    void MoldBenchSubset(const array<uint>&in classes, uint m, array<uint>&inout ids)
+    {
+        ids.resize(0);
+        for (uint b = 0; b < classes.length(); b++)
+        {
+            if ((m & (1 << b)) != 0)
+                ids.insertLast(classes[b]);
+        }
+    }
+    
+    //Creates 10000 molds from subsets of 14 classes and looks them all up
+    //again. Molds are never destroyed, so this runs last.
+    [Benchmark]
+    void MoldCreationBenchmark()
+    {
+        array<uint>@ classes = MoldBenchIds(14);
+        array<EntityMold@> molds;
+        array<uint> ids;
+        
+        double start = BenchmarkTime();
+        for (uint m = 1; m <= MoldBenchMolds; m++)
+        {
+            MoldBenchSubset(classes, m, ids);
+            molds.insertLast(ESM::GetMold(ids));
+        }
+        ReportBenchmark("MoldCreationBenchmark create", BenchmarkTime() - start, MoldBenchMolds);
+        
+        //Every subset is a mold of its own, found again on lookup
+        start = BenchmarkTime();
+        for (uint m = 1; m <= MoldBenchMolds; m++)
+        {
+            MoldBenchSubset(classes, m, ids);
+            Assert(ESM::GetMold(ids) is molds[m - 1]);
+        }
+        ReportBenchmark("MoldCreationBenchmark lookup", BenchmarkTime() - start, MoldBenchMolds);
+        
+        for (uint m = 1; m < MoldBenchMolds; m++)
+            Assert(molds[m] !is molds[m - 1]);
     }
     
     [Component]
@@ -3,10 +3,16 @@
 #include <scriptarray/scriptarray.h>
 #include <scriptbuilder/scriptbuilder.h>
 #include <vector>
+#include <string>
 #include <map>
 #include <unordered_map>
 #include <sstream>
 #include <memory>
+#include <cstddef>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 
 
@@ -43,6 +49,9 @@ class ComponentClass;
 class Entity;
 class EntitySystemManager;
 class EntitySystem;
+class EntityArchetype;
+class EntitySlab;
+class ComponentQuery;
 
 
 
@@ -66,15 +75,57 @@ struct EntityType
         size_t eventIndex;
     };
 
-    uint32_t hash;
-    bool hasCollisions = false;
+    //mold id
+    unsigned int id;
+    //hash of the sorted component ids, see EntitySystemManager::getMoldId
+    uint64_t hash;
     std::vector<ComponentClass*> componentTypes;
 
     //stores all the valid component references
     std::vector<EntityComponentReference> componentReferences;
 
-    //stores all event handlers
-    std::unordered_map<unsigned int, std::vector<ComponentEventHandlerIndex>> eventHandlers;
+    //stores all event handlers, indexed by dense event index
+    std::vector<std::vector<ComponentEventHandlerIndex>> eventHandlers;
+
+    //component slot indexed by ComponentClass::index, -1 if not present
+    std::vector<int> slotByClass;
+
+    //Copy plain data components from a prototype instead of running the
+    //factories, see EntitySystem::buildEntityComponents
+    bool prototypeCloning = false;
+};
+
+/*! \brief Molds matching a set of component classes
+
+    Shared by all the Query objects of one template instance. New molds are
+    matched incrementally, existing molds never change their components.
+*/
+struct MoldQuery
+{
+    //type id sequence numbers of the queried classes, in template order
+    std::vector<unsigned int> seqs;
+    //dense class indices, empty until every class has been registered
+    std::vector<unsigned int> classes;
+
+    //number of molds already matched against
+    size_t scannedMolds = 0;
+    std::vector<unsigned int> molds;
+};
+
+/*! \brief Generational handle to an entity
+
+    Unlike Entity@ the handle does not keep the entity alive. Index 0 is
+    never used, so a zeroed handle is always invalid.
+*/
+struct EntityId
+{
+    uint32_t index = 0;
+    uint32_t generation = 0;
+
+    bool operator==(const EntityId& o) const
+    {
+        return index == o.index && generation == o.generation;
+    }
 };
 
 struct ReferenceOffset
@@ -87,23 +138,58 @@ struct ReferenceOffset
     {};
 };
 
+struct ComponentEventHandler
+{
+    //dense event index, see EntitySystemManager::getEventIndex
+    unsigned int event;
+    asIScriptFunction* function;
+
+    //[ParallelSafe], may run concurrently with other handlers of the event
+    bool parallelSafe = false;
+
+    //[Every=N], global events reach 1/N of the components per dispatch
+    unsigned int every = 1;
+};
+
+//Primitive property of a component class, see EntitySystem::gatherProperty
+struct NumericProperty
+{
+    std::string name;
+    int typeId;
+    int offset;
+};
+
 class ComponentClass
 {
     const char* name;
+    //type id sequence number
     unsigned int id;
+    //dense index assigned in registration order
+    unsigned int index;
 
     asITypeInfo* typeInfo;
 
     asIScriptFunction* factory;
-    std::vector<std::pair<unsigned int, asIScriptFunction*>> eventHandlers;
+    std::vector<ComponentEventHandler> eventHandlers;
 
     ReferenceOffset entityReference;
     std::vector<std::pair<unsigned int, ReferenceOffset>> componentReferences;
 
+    //Only primitives and the Entity@ entity back reference, so a memberwise
+    //copy of the prototype equals a constructed instance
+    bool plainData = true;
+    //Built on first use by a mold with prototype cloning enabled
+    asIScriptObject* prototype = nullptr;
+
+    //Integer and floating point properties, including the inherited ones
+    std::vector<NumericProperty> numericProperties;
+
 public:
     ComponentClass(const char* name, asIScriptFunction* constructor, asITypeInfo*);
     ~ComponentClass();
 
+    const NumericProperty* findNumericProperty(const char* name) const;
+
     friend class Entity;
     friend class EntitySystem;
     friend class EntitySystemManager;
@@ -117,15 +203,23 @@ class Component
 
     asIScriptObject* object = nullptr;
 
+    //Construction order among the components of the class, [Every=N]
+    //handlers reach the components with stagger % N equal to the phase
+    unsigned int stagger = 0;
+
     //see Entity::dead
     bool dead = false;
 public:
 
+    Component()
+    {};
+
     Component(Component&& c)
     {
         entity = c.entity;
         componentClass = c.componentClass;
         object = c.object;
+        stagger = c.stagger;
 
         c.entity = nullptr;
         c.componentClass = nullptr;
@@ -147,11 +241,108 @@ public:
     friend class EntitySystem;
     friend class Entity;
     friend class ComponentIterator;
+    friend class ComponentQuery;
+    friend class EntityArchetype;
+    friend class EntitySlab;
+};
+
+/*! \brief Fixed size block of entities of a single mold
+
+    Every component slot of the mold has its own contiguous column of
+    component objects. Rows of dead entities hold nullptr objects until
+    cleanUp removes them.
+*/
+struct EntityChunk
+{
+    //rows in use
+    size_t count = 0;
+    //rows available
+    size_t capacity;
+
+    std::vector<Entity*> entities;
+    //Entity::tags of every row
+    std::vector<uint32_t> tags;
+    //column for slot N starts at N * capacity
+    std::vector<asIScriptObject*> objects;
+
+    EntityChunk(size_t slots, size_t cap) : capacity(cap)
+    {
+        entities.resize(cap, nullptr);
+        tags.resize(cap, 0);
+        objects.resize(slots * cap, nullptr);
+    }
+
+    asIScriptObject** column(size_t slot)
+    {
+        return objects.data() + slot * capacity;
+    }
+};
+
+//! Components of an entity, stored in the same slab slot as the entity
+class ComponentSpan
+{
+    Component* first = nullptr;
+    size_t count = 0;
+public:
+    ComponentSpan()
+    {};
+    ComponentSpan(Component* f, size_t n) : first(f), count(n)
+    {};
+
+    Component* begin() const
+    {
+        return first;
+    }
+
+    Component* end() const
+    {
+        return first + count;
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    Component& operator[](size_t i) const
+    {
+        return first[i];
+    }
 };
 
 class Entity
 {
-    std::vector<Component> components;
+    ComponentSpan components;
+
+    //The slab this entity was allocated from
+    EntitySlab* slab = nullptr;
+
+    //Location in the archetype storage, set when spawned
+    EntityChunk* chunk = nullptr;
+    size_t chunkRow = 0;
+
+    //Index in EntitySystem::entitySlots, 0 when not alive
+    uint32_t slot = 0;
+
+    //Index in EntitySystem::allEntities
+    size_t listIndex = 0;
+
+    //Listed in EntitySystem::killedEntities
+    bool killPending = false;
+
+    //Dormant entities are kept out of the archetype chunks, so only local
+    //events reach them. Changes are applied by updateEntityLists.
+    bool dormant = false;
+    bool dormantRequested = false;
+    bool dormancyPending = false;
+
+    //Script defined tag bits, mirrored in the chunk row
+    uint32_t tags = 0;
+
+    //Location in EntitySystem::spatialGrid, valid while positioned
+    uint64_t spatialCell = 0;
+    size_t spatialRow = 0;
+    bool positioned = false;
 
     //Dead entity essentially marks an "removed entity"
     //dead entities will be removed upon cleanUp
@@ -159,9 +350,6 @@ class Entity
     //entities marked as dead are ignored in events/component iteration
     bool dead = false;
 
-    //reused entities have all the components already in the lists
-    bool reused = false;
-
 
     int refCount = 1;
     void setDead(bool new_dead)
@@ -169,16 +357,24 @@ class Entity
         if (new_dead)
             id = 0;
         dead = new_dead;
-        for (auto& e : components)
+        for (size_t i = 0; i < components.size(); i++)
         {
+            auto& e = components[i];
             if (new_dead)
+            {
+                if (chunk)
+                    chunk->column(i)[chunkRow] = nullptr;
                 e.releaseObject();
+            }
             e.dead = new_dead;
         }
     }
     const EntityType* type;
     EntitySystem* system;
     unsigned int id;
+
+    //Destructs the components and returns the memory to the slab
+    void destroy();
 public:
 
     bool equals(Entity* e) const
@@ -202,6 +398,29 @@ public:
         return id;
     }
 
+    EntityId getHandle() const;
+
+    bool isDormant() const
+    {
+        return dormant;
+    }
+    void setDormant(bool d);
+
+    uint32_t getTags() const
+    {
+        return tags;
+    }
+
+    //! Component::stagger of a component slot
+    unsigned int getStagger(size_t slot) const
+    {
+        return components[slot].stagger;
+    }
+    void setTags(uint32_t t);
+    void setTag(unsigned int tag);
+    void clearTag(unsigned int tag);
+    bool hasTag(unsigned int tag) const;
+
     void addRef()
     {
         asAtomicInc(refCount);
@@ -209,11 +428,11 @@ public:
 
     void release()
     {
-        asAtomicDec(refCount);
-        if (refCount <= 0)
+        //The last reference may be dropped by any thread
+        if (asAtomicDec(refCount) <= 0)
         {
             setDead(true);;
-            delete this;
+            destroy();
         }
     }
 
@@ -233,37 +452,496 @@ public:
     bool getComponentObject(void* ptr, int tid);
 
     unsigned int sendSpecialEventNowInContext(int seid, asIScriptContext* context);
-    unsigned int sendEventNowInContext(asIScriptObject* ptr, int tid, asIScriptContext* context);
+    unsigned int sendEventNowInContext(asIScriptObject* ptr, unsigned int event, asIScriptContext* context);
     unsigned int sendEventNow(asIScriptObject* ptr, int tid);
 
     friend class EntitySystem;
     friend class Component;
     friend class EntityIterator;
     friend class EntitySystemManager;
+    friend class EntityArchetype;
+    friend class EntitySlab;
+    friend class SpatialGrid;
+};
+
+/*! \brief Fixed size block allocator for the entities of a single mold
+
+    Every slot holds an Entity immediately followed by its components, so
+    constructing an entity is a single free list pop. Memory is returned to
+    the system only when the slab itself is destroyed.
+
+    The free list is locked, the last Entity@ may be released by a worker
+    thread while the owning thread allocates.
+*/
+class EntitySlab
+{
+    size_t componentCount;
+    size_t slotSize;
+    size_t slotsPerBlock;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    void* freeList = nullptr;
+    size_t used = 0;
+    bool orphaned = false;
+    mutable std::mutex mutex;
+
+    static size_t componentsOffset();
+public:
+    EntitySlab(size_t componentCount, size_t slotsPerBlock);
+
+    //! Allocate an Entity with default constructed components
+    Entity* allocate();
+
+    //! Return the memory of a destructed entity
+    void deallocate(Entity* e);
+
+    /*! \brief Give up the ownership of the slab
+
+        The slab is deleted immediately if no entities are in use or
+        later when the last entity is deallocated.
+    */
+    void orphan();
+
+    size_t getUsed() const
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        return used;
+    }
+
+    size_t getCapacity() const
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        return blocks.size() * slotsPerBlock;
+    }
+};
+
+//! Column of a single component class in an archetype
+struct ArchetypeColumn
+{
+    EntityArchetype* archetype;
+    size_t slot;
+};
+
+//! Event handler of a single component class in an archetype
+struct ArchetypeEventBinding
+{
+    EntityArchetype* archetype;
+    size_t slot;
+    asIScriptFunction* handler;
+    bool parallelSafe;
+    unsigned int every;
+};
+
+/*! \brief Worker threads for running [ParallelSafe] event handlers
+
+    Each worker requests its own context from the engine, so the
+    application must have called asPrepareMultithread. The thread calling
+    dispatch works on the tasks as well.
+*/
+class EventWorkerPool
+{
+public:
+    //! Handler call for a run of component objects
+    struct Task
+    {
+        asIScriptFunction* handler;
+        asIScriptObject** objects;
+        size_t count;
+
+        //rows with all the mask bits in their tags, all if mask is zero
+        const uint32_t* tags;
+        uint32_t mask;
+
+        //rows whose component stagger % every equals phase
+        Entity* const* entities;
+        size_t slot;
+        unsigned int every;
+        unsigned int phase;
+    };
+private:
+    asIScriptEngine* engine;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wakeCv;
+    std::condition_variable doneCv;
+    bool quit = false;
+
+    //incremented for every dispatched batch of tasks
+    size_t batch = 0;
+    size_t busyWorkers = 0;
+
+    const std::vector<Task>* tasks = nullptr;
+    asIScriptObject* event = nullptr;
+    std::atomic<size_t> nextTask;
+
+    void workerMain();
+    void runTasks(asIScriptContext* ctx);
+public:
+    size_t size() const
+    {
+        return threads.size();
+    }
+    EventWorkerPool(asIScriptEngine* engine, unsigned int threadCount);
+    ~EventWorkerPool();
+
+    //! Run all the tasks with the event and wait until they are finished
+    void dispatch(const std::vector<Task>& tasks, asIScriptObject* event, asIScriptContext* ctx);
+};
+
+/*! \brief Hierarchical timer wheel of delayed events
+
+    Four levels of 64 slots cover 2^24 ticks. Timers further away are
+    parked in the last level and placed again when it is cascaded.
+    Advancing a tick touches only the timers that are due or cascaded.
+    The wheel has no notion of time, a tick is one advance call of its
+    owner.
+*/
+class EventTimerWheel
+{
+public:
+    struct Timer
+    {
+        //nullptr for global events
+        Entity* entity;
+        unsigned int event;
+        unsigned char coalesce;
+        asIScriptObject* object;
+        uint64_t due;
+    };
+
+    static const unsigned int SlotBits = 6;
+    static const unsigned int Slots = 1 << SlotBits;
+    static const unsigned int Levels = 4;
+private:
+    uint64_t tick = 0;
+    size_t count = 0;
+    std::vector<Timer> slots[Levels][Slots];
+
+    void place(const Timer& t);
+public:
+    //! Add a timer due after the given number of ticks, at least one
+    void schedule(const Timer& t, unsigned int ticks);
+
+    //! Advance one tick and append the timers now due to out
+    void advance(std::vector<Timer>& out);
+
+    //! Remove all the timers, appending them to out
+    void clear(std::vector<Timer>& out);
+
+    size_t size() const
+    {
+        return count;
+    }
+};
+
+/*! \brief Uniform grid of entity positions for neighbourhood queries
+
+    Cells are kept in a hash map, so the covered space is unbounded and
+    only occupied cells cost memory. Positions are stored next to the
+    entity pointers in the cells, moving within a cell is a plain store.
+*/
+class SpatialGrid
+{
+public:
+    struct Item
+    {
+        Entity* entity;
+        float x, y, z;
+    };
+private:
+    float cellSize = 16.0f;
+    float invCellSize = 1.0f / 16.0f;
+    size_t count = 0;
+    std::unordered_map<uint64_t, std::vector<Item>> cells;
+
+    int cellCoord(float v) const;
+    static uint64_t cellKey(int cx, int cy, int cz);
+    void insert(uint64_t key, const Item& item);
+
+    template<class F>
+    void forEachInBox(float minX, float minY, float minZ, float maxX, float maxY, float maxZ, F f) const;
+public:
+    //! Insert or move the entity
+    void set(Entity* e, float x, float y, float z);
+
+    //! Remove the entity if it is positioned
+    void remove(Entity* e);
+
+    //! Change the cell edge length, the positioned entities are rehashed
+    void setCellSize(float size);
+
+    float getCellSize() const
+    {
+        return cellSize;
+    }
+
+    //! Append the entities inside the box, bounds included
+    void queryBox(float minX, float minY, float minZ, float maxX, float maxY, float maxZ, std::vector<Entity*>& out) const;
+
+    //! Append the entities within the radius of the point
+    void queryRadius(float x, float y, float z, float radius, std::vector<Entity*>& out) const;
+
+    //! Remove all the entities
+    void clear();
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    size_t cellCount() const
+    {
+        return cells.size();
+    }
+};
+
+/*! \brief Lock-free list of entity system commands issued by a thread
+
+    Any number of threads may push, the thread owning the EntitySystem
+    takes all the commands at once.
+*/
+class DeferredCommandBuffer
+{
+public:
+    enum Type
+    {
+        Spawn,
+        Kill,
+        LocalEvent,
+        GlobalEvent
+    };
+
+    //References to the entity and the event are held by the command
+    struct Command
+    {
+        Type type;
+        const EntityType* mold = nullptr;
+        Entity* entity = nullptr;
+        asIScriptObject* event = nullptr;
+        unsigned int eventIndex = 0;
+        unsigned char coalesce = 0;
+        Command* next = nullptr;
+    };
+private:
+    std::atomic<Command*> head;
+public:
+    DeferredCommandBuffer() : head(nullptr)
+    {}
+
+    void push(Command* c);
+
+    //! Take all the commands, in push order
+    Command* takeAll();
+};
+
+/*! \brief Storage for all the spawned entities of a single mold
+
+    Entities are packed into fixed size chunks so that iterating components
+    of a class walks contiguous arrays instead of chasing pointers.
+*/
+class EntityArchetype
+{
+    const EntityType* type;
+    size_t chunkCapacity;
+    std::vector<std::unique_ptr<EntityChunk>> chunks;
+
+    //last emptied chunk, kept to avoid churn at a chunk boundary
+    std::unique_ptr<EntityChunk> spareChunk;
+
+    //bumped whenever a chunk is added to or removed from chunks
+    size_t version = 0;
+public:
+    EntityArchetype(const EntityType* type, size_t chunkCapacity);
+
+    //! Place a spawned entity into the storage
+    void add(Entity* e);
+
+    //! Remove an entity by moving the last row in its place
+    void remove(Entity* e);
+
+    //! Forget all the entities without touching them further
+    void detachAll();
+
+    size_t size() const;
+
+    friend class EntitySystem;
+    friend class ComponentIterator;
+    friend class ComponentQuery;
+    friend class CachedComponentQuery;
 };
 
 
 class ECSIterator
 {
+protected:
+    //nullptr once the system has been destroyed
+    EntitySystem* system;
+
+    //EntitySystem::structureEpoch at construction
+    size_t epoch;
+
+    //intrusive list of the iterators alive in the system
+    ECSIterator* prevActive = nullptr;
+    ECSIterator* nextActive = nullptr;
+    void unlink();
+
+    //! Mark the iterator invalidated if the entity lists have changed
+    void checkEpoch();
 public:
+    ECSIterator(EntitySystem* sys);
+    ~ECSIterator();
+
+    //! Detach from a system being destroyed
+    void orphan();
+
     bool finished = false;
     bool invalidated = false;
 };
 
 class ComponentIterator : public ECSIterator
 {
-    typedef std::vector<Component*> VecType;
+    typedef std::vector<ArchetypeColumn> VecType;
 
-    VecType::iterator vecIterator;
-    VecType::iterator vecEnd;
-    EntitySystem* system;
+    const VecType* columns;
+    size_t columnIndex = 0;
+    size_t chunkIndex = 0;
+    size_t row = 0;
+    asIScriptObject* current = nullptr;
+
+    //only entities with all of these tags are returned
+    uint32_t tagMask;
+
+    void advance();
 public:
-    ComponentIterator(EntitySystem* sys, VecType* vec);
+    ComponentIterator(EntitySystem* sys, VecType* vec, uint32_t tagMask = 0);
 
     asIScriptObject* next();
     void release();
 };
 
+/*! \brief Iterates the components of a class in ascending order of a
+    numeric property
+
+    The order is fixed when the iterator is constructed, see
+    EntitySystem::sortComponents.
+*/
+class SortedComponentIterator : public ECSIterator
+{
+    std::shared_ptr<const std::vector<asIScriptObject*>> order;
+    size_t index = 0;
+public:
+    SortedComponentIterator(EntitySystem* sys, std::shared_ptr<const std::vector<asIScriptObject*>> order);
+
+    asIScriptObject* next();
+    void release();
+};
+
+/*! \brief Row walk shared by the Query and CachedQuery types
+
+    Derived finds the chunks of the matching molds through nextChunk, which
+    returns nullptr at the end and points slots at the columns of the
+    queried classes in the returned chunk. Rows whose tags column lacks a
+    bit of the tag mask are skipped.
+*/
+template<class Derived>
+class QueryCursor : public ECSIterator
+{
+public:
+    static const unsigned int MaxComponents = 3;
+protected:
+    EntityChunk* chunk = nullptr;
+    const int* slots = nullptr;
+    size_t row = 0;
+    Entity* current = nullptr;
+
+    //number of queried classes
+    size_t classCount = 0;
+
+    //only entities with all of these tags are returned
+    uint32_t tagMask;
+
+    //script exception of a next call after the lists have changed
+    const char* invalidatedMessage;
+
+    bool advance(asIScriptObject** out);
+public:
+    QueryCursor(EntitySystem* sys, const char* invalidatedMessage, uint32_t tagMask);
+
+    bool next2(asIScriptObject** a, asIScriptObject** b);
+    bool next3(asIScriptObject** a, asIScriptObject** b, asIScriptObject** c);
+
+    //! Entity of the components returned by the last next
+    Entity* getEntity();
+};
+
+/*! \brief Iterates entities having all of the queried components
+
+    Walks the archetype chunks of the matching molds, so entities without
+    the components are never visited.
+*/
+class ComponentQuery : public QueryCursor<ComponentQuery>
+{
+    const MoldQuery* query;
+    size_t moldIndex = 0;
+    size_t chunkIndex = 0;
+    EntityArchetype* archetype = nullptr;
+    int archetypeSlots[MaxComponents];
+
+    bool nextArchetype();
+    EntityChunk* nextChunk();
+public:
+    ComponentQuery(EntitySystem* sys, const MoldQuery* q, uint32_t tagMask = 0);
+
+    void release();
+
+    friend class QueryCursor<ComponentQuery>;
+};
+
+/*! \brief Persistent query keeping its matching chunks across passes
+
+    reset() starts a new pass and rebuilds the chunk list only if one of
+    the matching archetypes has gained or lost chunks since the last one.
+    Row counts are read live, so spawns and kills within existing chunks
+    cost nothing.
+*/
+class CachedComponentQuery : public QueryCursor<CachedComponentQuery>
+{
+    struct Range
+    {
+        EntityChunk* chunk;
+        int slots[MaxComponents];
+    };
+
+    //Shared with the manager's table, which may replace or drop its entry
+    //while a long-lived query still uses it
+    std::shared_ptr<MoldQuery> query;
+    //Template instance keying the table, kept alive with the query
+    asITypeInfo* type;
+    std::vector<Range> ranges;
+
+    //archetype and its version for every matching mold at the last rebuild
+    std::vector<std::pair<const EntityArchetype*, size_t>> seen;
+    //EntitySystem::archetypeGeneration at the last rebuild
+    size_t generation = 0;
+
+    size_t rangeIndex = 0;
+    int refCount = 1;
+
+    const EntityArchetype* findArchetype(unsigned int mold) const;
+    bool isStale() const;
+    void rebuild();
+    EntityChunk* nextChunk();
+public:
+    CachedComponentQuery(EntitySystem* sys, asITypeInfo* type, std::shared_ptr<MoldQuery> q, uint32_t tagMask = 0);
+    ~CachedComponentQuery();
+
+    //! Start a new pass over the matching entities
+    void reset();
+
+    void addRef();
+    void release();
+
+    friend class QueryCursor<CachedComponentQuery>;
+};
 
 class EntityIterator : public ECSIterator
 {
@@ -271,9 +949,13 @@ class EntityIterator : public ECSIterator
 
     VecType::iterator vecIterator;
     VecType::iterator vecEnd;
-    EntitySystem* system;
+
+    //only entities with all of these tags are returned
+    uint32_t tagMask;
+
+    bool skip(const Entity* e) const;
 public:
-    EntityIterator(EntitySystem* sys, VecType* vec);
+    EntityIterator(EntitySystem* sys, VecType* vec, uint32_t tagMask = 0);
 
     Entity* next();
     void release();
@@ -289,36 +971,171 @@ class EntitySystem
 {
     struct EntityEvent
     {
+        //dense event index
         unsigned int id;
         asIScriptObject* event;
+        //global events only reach entities with all the tags, zero for all
+        uint32_t tagMask;
     };
 
     std::vector<EntityEvent> preparedGlobalEvents;
     std::vector<std::pair<Entity*, EntityEvent>> preparedLocalEvents;
 
+    //Queue positions of the coalesced events. Global positions are indexed
+    //by dense event index and valid only if their stamp is current.
+    struct LocalEventKey
+    {
+        Entity* entity;
+        unsigned int event;
+        bool operator==(const LocalEventKey& o) const
+        {
+            return entity == o.entity && event == o.event;
+        }
+    };
+    struct LocalEventKeyHash
+    {
+        size_t operator()(const LocalEventKey& k) const
+        {
+            return std::hash<Entity*>()(k.entity) ^ (k.event * (size_t) 0x9e3779b9u);
+        }
+    };
+    std::unordered_map<LocalEventKey, size_t, LocalEventKeyHash> coalescedLocalEvents;
+    std::vector<std::pair<size_t, size_t>> coalescedGlobalEvents;
+    size_t globalQueueStamp = 1;
+    //Global events aimed at tagged entities, keyed by event index and tag
+    //mask. Events with different masks reach different entities and are
+    //never merged.
+    std::unordered_map<uint64_t, size_t> coalescedTaggedGlobalEvents;
+
+    //global sends per event index, staggers the [Every=N] handlers
+    std::vector<size_t> eventDispatchCounts;
+
+    //! Queue position of an already queued event to coalesce with or nullptr
+    size_t* findCoalesced(Entity* e, unsigned int event, size_t position, uint32_t tagMask = 0);
+
+    //Queue validated events, references are added
+    void enqueueGlobalEvent(asIScriptObject* o, unsigned int event, int coalesce, uint32_t tagMask = 0);
+    void enqueueLocalEvent(Entity* e, asIScriptObject* o, unsigned int event, int coalesce);
+
+    //Delayed events, one tick per sendEvents call, not per frame
+    EventTimerWheel timers;
+
+    //Positions registered with ESM::SetPosition
+    SpatialGrid spatialGrid;
+    std::vector<Entity*> spatialResults;
+    CScriptArray* spatialResultsArray();
+    std::vector<EventTimerWheel::Timer> dueTimers;
+    void releaseTimers(std::vector<EventTimerWheel::Timer>& vec);
+
+    //Deferred commands by merge order key, see setDeferredCommandIndex
+    std::map<uint64_t, std::unique_ptr<DeferredCommandBuffer>> commandBuffers;
+    std::mutex commandBufferMutex;
+    std::atomic<bool> hasDeferredCommands;
+    std::vector<DeferredCommandBuffer::Command*> deferredCommands;
+
+    //unique for every EntitySystem constructed, see getCommandBuffer
+    uint64_t serial;
+
+    DeferredCommandBuffer* getCommandBuffer();
+    void pushDeferred(DeferredCommandBuffer::Command* c);
+
+    //! Run (or with apply false just release) all the deferred commands
+    void mergeDeferredCommands(bool apply = true);
+
     //used for "double buffering"
     std::vector<EntityEvent> preparedGlobalEventsSwap;
     std::vector<std::pair<Entity*, EntityEvent>> preparedLocalEventsSwap;
 
-    std::unordered_map<unsigned int, std::vector<Component*>> componentsByClass;
-    std::unordered_map<unsigned int, std::vector<std::pair<Component*, unsigned int>>> componentsByEvent;
+    //indexed by ComponentClass::index
+    std::vector<std::vector<ArchetypeColumn>> componentsByClass;
+    //indexed by dense event index
+    std::vector<std::vector<ArchetypeEventBinding>> componentsByEvent;
+
+    //indexed by mold id, constructed when the first entity is spawned
+    std::vector<std::unique_ptr<EntityArchetype>> archetypes;
+    size_t archetypeChunkSize = 256;
+    EntityArchetype* getArchetype(const EntityType* type);
+
+    //indexed by mold id, orphaned on destruction as entities may outlive us
+    std::vector<EntitySlab*> slabs;
+    size_t slabBlockSize = 64;
+    EntitySlab* getSlab(const EntityType* type);
 
     EntitySystemManager* manager;
     std::vector<Entity*> allEntities;
 
+    //killed since the last cleanUp, only these are visited by it
+    std::vector<Entity*> killedEntities;
+
     std::vector<Entity*> entitiesToKill;
     std::vector<Entity*> entitiesToSpawn;
 
+    //Entities with Entity::dormancyPending set
+    std::vector<Entity*> dormancyChanges;
+    void applyDormancyChanges();
+
+    struct EntitySlot
+    {
+        Entity* entity = nullptr;
+        uint32_t generation = 1;
+    };
+
+    //Dense handle table, the generation is bumped whenever a slot is freed
+    std::vector<EntitySlot> entitySlots;
+    std::vector<uint32_t> freeEntitySlots;
+    void acquireSlot(Entity* e);
+    void releaseSlot(Entity* e);
+
     //used for "double buffering"
     std::vector<Entity*> entitiesToKillSwap;
     std::vector<Entity*> entitiesToSpawnSwap;
 
-    std::set<ComponentIterator*> activeComponentIterators;
-    std::set<EntityIterator*> activeEntityIterators;
+    //Bumped on every structural change to the entity lists, iterators
+    //constructed before the change are invalid
+    size_t structureEpoch = 0;
+
+    //Bumped when all the archetypes are destroyed by clear()
+    size_t archetypeGeneration = 0;
 
-    std::unordered_map<uint32_t, std::unique_ptr<std::vector<Entity*>>> deadEntitiesByTypeHash;
+    //structureEpoch and value count of the last gatherProperty by class index
+    std::vector<std::pair<size_t, size_t>> gatherStates;
+    std::vector<float> gatherBuffer;
 
-    void buildEntityComponents(Entity* entity);
+    //Bumped by class index when a spawn, kill or dormancy change adds or
+    //removes live components of the class
+    std::vector<size_t> classEpochs;
+    void touchClasses(const EntityType* type);
+    size_t getClassEpoch(const ComponentClass* cls) const;
+
+    //Last order of every sorted class property, keyed by class index and
+    //property offset. Keys are the property values as sortable integers.
+    struct SortCache
+    {
+        //classEpochs of the class when the order was built
+        size_t epoch = (size_t)-1;
+        std::shared_ptr<std::vector<asIScriptObject*>> order;
+        std::vector<uint64_t> keys;
+    };
+    std::unordered_map<uint64_t, SortCache> sortCaches;
+    std::vector<asIScriptObject*> sortObjectsScratch;
+    std::vector<uint64_t> sortKeysScratch;
+    //! Stable LSD radix sort over the low bits of the keys
+    void radixSort(std::vector<asIScriptObject*>& objects, std::vector<uint64_t>& keys, unsigned int bits);
+
+    //! Call f for the object of every live component of the class
+    template<class F>
+    void forEachLiveComponent(ComponentClass* cls, F f);
+
+    //indexed by mold id, dead entities only referenced by the system
+    std::vector<std::vector<Entity*>> deadEntitiesByMold;
+    size_t recycleLimit = 1024;
+
+    void buildEntityComponents(Entity* entity, asIScriptContext* ctx);
+    Entity* constructEntityInContext(const EntityType* type, asIScriptContext* ctx);
+
+    //Construct count entities sharing one context, handles are stored in
+    //out or released if it is nullptr
+    void constructEntities(const EntityType* type, unsigned int count, CScriptArray* out);
     void buildEntityComponentReferences(Entity* entity, const EntityType* type);
     
 
@@ -327,11 +1144,48 @@ class EntitySystem
     void invalidateIterators();
     void clearPreparedEvents();
 
+    //Head of the intrusive list of live iterators
+    ECSIterator* activeIterators = nullptr;
+
+    //Storage of released iterators, reused by the next construction
+    std::vector<void*> componentIteratorPool;
+    std::vector<void*> entityIteratorPool;
+    std::vector<void*> queryPool;
+    std::vector<void*> sortedIteratorPool;
+    void* allocateIterator(std::vector<void*>& pool, size_t size, size_t& hits);
+    void recycleEntity(Entity* e);
+
     size_t stat_entityIteratorsConstructed = 0;
     size_t stat_componentIteratorsConstructed = 0;
+    size_t stat_entityIteratorPoolHits = 0;
+    size_t stat_componentIteratorPoolHits = 0;
+    size_t stat_queriesConstructed = 0;
+    size_t stat_queryPoolHits = 0;
+    size_t stat_cachedQueryRebuilds = 0;
+    size_t stat_radixSorts = 0;
+    size_t stat_incrementalSorts = 0;
     size_t stat_entityConstructions = 0;
+    size_t stat_entitiesRecycled = 0;
     size_t stat_globalEventsSent = 0;
     size_t stat_localEventsSent = 0;
+    size_t stat_eventsCoalesced = 0;
+    size_t stat_timedEventsScheduled = 0;
+    size_t stat_timedEventsDropped = 0;
+    size_t stat_deferredCommands = 0;
+    size_t stat_componentsCloned = 0;
+    size_t stat_dormancyChanges = 0;
+    size_t stat_handlerGroupsDispatched = 0;
+    size_t stat_handlerCalls = 0;
+    size_t stat_staggeredSkips = 0;
+    size_t stat_parallelTasks = 0;
+
+    std::unique_ptr<EventWorkerPool> workerPool;
+    std::vector<EventWorkerPool::Task> parallelTasks;
+
+    //Components constructed so far by class index, see Component::stagger
+    std::vector<unsigned int> staggerCounters;
+    //! Run the collected parallelTasks unless the lists changed since epoch
+    void flushParallelTasks(asIScriptObject* event, asIScriptContext* ctx, size_t epoch);
     unsigned int lastEntityId = 0;
     unsigned int getNextEntityId()
     {
@@ -367,22 +1221,161 @@ public:
     void prepareGlobalEvent(asIScriptObject*, int);
     void prepareLocalEvent(Entity*, asIScriptObject*, int);
 
+    //! Global event handled only by entities having all the tags in mask
+    void prepareGlobalEventWithTags(asIScriptObject*, int, uint32_t tagMask);
+
+    /*! \brief Queue events delivered by the ticks-th sendEvents call from now
+
+        The delay is counted in sendEvents calls, not in frames or
+        updateEntityLists calls. An application sending events several
+        times per frame has to scale the delay by that count. Zero ticks
+        behaves like one, a refused recursive sendEvents call is no tick.
+        Local events of entities dead by then are dropped without a script
+        call.
+
+        Script: ESM::QueueGlobalEventAfter(?&in, uint ticks) and
+        ESM::QueueLocalEventAfter(Entity&, ?&in, uint ticks)
+    */
+    void prepareGlobalEventAfter(asIScriptObject*, int, unsigned int ticks);
+    void prepareLocalEventAfter(Entity*, asIScriptObject*, int, unsigned int ticks);
+
     Entity* constructEntity(const EntityType* type);
     Entity* constructEntity(unsigned int moldId);
+
+    //! Construct a burst of entities, returning their handles
+    CScriptArray* constructEntitiesArray(const EntityType* type, unsigned int count);
+    //! Construct a burst of entities without returning them
+    void spawnEntities(const EntityType* type, unsigned int count);
+
+    //! Position used by the neighbourhood queries, ignored for dead entities
+    void setPosition(Entity* e, float x, float y, float z);
+    void removePosition(Entity* e);
+    void setSpatialCellSize(float size);
+    float getSpatialCellSize() const
+    {
+        return spatialGrid.getCellSize();
+    }
+
+    //! Positioned entities within the radius, or inside the box
+    CScriptArray* queryRadius(float x, float y, float z, float radius);
+    CScriptArray* queryBox(float minX, float minY, float minZ, float maxX, float maxY, float maxZ);
+
+    /*! \brief Pack a float property of every live component of the class
+
+        Values are appended in component iteration order. Returns false if
+        the class has no float property of the name.
+    */
+    bool gatherProperty(ComponentClass* cls, const char* property, std::vector<float>& out);
+
+    /*! \brief Write values back in the order of the last gather of the class
+
+        Fails if the entity lists have changed since the gather or the
+        value count does not match the live components.
+    */
+    bool scatterProperty(ComponentClass* cls, const char* property, const float* values, size_t count);
+
+    /*! \brief Live components of the class in ascending order of the property
+
+        The previous order of the same property is reused while the entity
+        lists are unchanged, a few changed values are fixed with an
+        insertion sort. Otherwise the components are radix sorted. Values
+        are compared exactly in their own type, ties keep the component
+        iteration order.
+    */
+    std::shared_ptr<const std::vector<asIScriptObject*>> sortComponents(ComponentClass* cls, const NumericProperty* prop);
+
+    //Script versions, the class id is from ComponentInfo<T>.getId()
+    CScriptArray* gatherFloatArray(unsigned int classId, const std::string& property);
+    void scatterFloatArray(unsigned int classId, const std::string& property, CScriptArray* values);
+
     void killEntity(Entity* e);
     void killAllEntities();
 
+    /*! \brief Thread safe variants of the above
+
+        The commands are applied at the start of the next updateEntityLists
+        or sendEvents call, grouped by the index of the issuing thread in
+        ascending order, see setDeferredCommandIndex.
+    */
+    void deferConstructEntity(const EntityType* type);
+    void deferKillEntity(Entity* e);
+    void deferLocalEvent(Entity*, asIScriptObject*, int);
+    void deferGlobalEvent(asIScriptObject*, int);
+
+    /*! \brief Set the merge order index of the calling thread
+
+        Threads share index 0 until they set one, commands of threads
+        sharing an index keep only their push order. Commands deferred by
+        [ParallelSafe] handlers are merged after all the others, in the
+        order of the handler tasks.
+    */
+    void setDeferredCommandIndex(unsigned int index);
+
+    //! Get the entity of a handle or nullptr if the entity is dead
+    Entity* resolve(EntityId id) const;
+
+    //! AngelScript EntityId::get, returns a new reference
+    Entity* resolveHandle(EntityId* id);
+    bool isHandleAlive(EntityId* id);
+
     ComponentIterator* constructComponentIterator(asITypeInfo* type);
+    ComponentIterator* constructComponentIteratorWithTags(asITypeInfo* type, uint32_t tagMask);
     void releaseComponentIterator(ComponentIterator* cls);
 
 
-    EntityIterator* constructEntityIterator();
+    EntityIterator* constructEntityIterator(uint32_t tagMask = 0);
     void releaseEntityIterator(EntityIterator*);
 
+    ComponentQuery* constructQuery(asITypeInfo* type);
+    ComponentQuery* constructQueryWithTags(asITypeInfo* type, uint32_t tagMask);
+    void releaseQuery(ComponentQuery*);
+
+    CachedComponentQuery* constructCachedQuery(asITypeInfo* type);
+    CachedComponentQuery* constructCachedQueryWithTags(asITypeInfo* type, uint32_t tagMask);
+
+    SortedComponentIterator* constructSortedComponentIterator(asITypeInfo* type, const std::string& property);
+    void releaseSortedComponentIterator(SortedComponentIterator*);
+
     void logDebugInfo();
 
+    /*! \brief Set the number of entities allocated at once per mold
+
+        Affects only the slabs of molds not yet constructed.
+    */
+    void setSlabBlockSize(size_t entities);
+
+    /*! \brief Set the maximum number of dead entities kept per mold
+
+        Kept entities are reused by constructEntity instead of allocating
+        new ones.
+    */
+    void setRecycleLimit(size_t entities);
+
+    /*! \brief Set the number of threads running [ParallelSafe] handlers
+
+        With zero threads (the default) all the handlers run serially on
+        the thread calling sendEvents. ParallelSafe handlers must not touch
+        the entity system or any state shared with other handlers.
+        Handlers keep their declaration order, the serial handlers wait
+        for the parallel handlers declared before them.
+    */
+    void setWorkerThreads(unsigned int threads);
+    unsigned int getWorkerThreads() const
+    {
+        return workerPool ? (unsigned int)workerPool->size() : 0;
+    }
+
+    //! Full radix sorts done by sortComponents since the last clear
+    unsigned int getRadixSorts() const
+    {
+        return (unsigned int)stat_radixSorts;
+    }
+
     void preallocate();
     friend class Entity;
+    friend class ECSIterator;
+    friend class ComponentQuery;
+    friend class CachedComponentQuery;
 
 
 };
@@ -390,12 +1383,36 @@ public:
 //! Global entity system information
 class EntitySystemManager
 {
-    std::unordered_map<uint32_t, size_t> moldIdsByHash;
+    //Open addressing table of mold ids keyed by the exact sorted component
+    //id sequence. Size is a power of two, -1 marks an empty bucket.
+    std::vector<int> moldTable;
+    void growMoldTable();
+
     std::vector<std::unique_ptr<EntityType>> entityMolds;
 
-    std::unordered_map<unsigned int, std::unique_ptr<ComponentClass>> classes;
+    //Query template instances, the subtypes are verified on lookup in
+    //case a discarded instance's address is reused
+    std::unordered_map<asITypeInfo*, std::shared_ptr<MoldQuery>> moldQueries;
+
+    //indexed by ComponentClass::index
+    std::vector<std::unique_ptr<ComponentClass>> classes;
+
+    //Type id sequence numbers are small and dense, so plain vectors map
+    //them to the dense indices. -1 marks types that are not components or
+    //have no event handlers.
+    std::vector<int> classIndexBySeq;
+    std::vector<int> eventIndexBySeq;
+
+    //CoalesceMode of the event classes, indexed by sequence number
+    std::vector<unsigned char> coalesceBySeq;
+
+    //Init and deinit take the first two event indices
+    unsigned int eventCount = 2;
+    unsigned int registerEvent(unsigned int seq);
     asIScriptEngine* engine;
     asITypeInfo* entityTypeInfo = nullptr;
+    asITypeInfo* entityArrayTypeInfo = nullptr;
+    asITypeInfo* floatArrayTypeInfo = nullptr;
 
     template <typename T, typename ... Args >
     void ilog(std::stringstream & logBuffer, T t, Args ... b)
@@ -423,7 +1440,17 @@ public:
         Error
     };
 
+    //! Handling of an event queued again for the same target, see [Event]
+    enum CoalesceMode
+    {
+        CoalesceNone = 0,
+        CoalesceLast,
+        CoalesceFirst
+    };
+
     EntityType* entityMoldFactory(uint32_t*);
+    //! ESM::GetMold, molds built from a runtime list of component ids
+    EntityType* entityMoldFromArray(CScriptArray*);
 
     template <typename ... Args >
     void log(LogLevel ll, Args ... b)
@@ -458,6 +1485,41 @@ public:
     void release();
     EntityType* getTypeByMoldId(unsigned int);
 
+    //! Get component class by type id sequence number or nullptr
+    ComponentClass* getClassBySeq(unsigned int seq) const
+    {
+        if (seq >= classIndexBySeq.size() || classIndexBySeq[seq] < 0)
+            return nullptr;
+        return classes[classIndexBySeq[seq]].get();
+    }
+
+    CoalesceMode getCoalesceMode(unsigned int seq) const
+    {
+        if (seq >= coalesceBySeq.size())
+            return CoalesceNone;
+        return (CoalesceMode) coalesceBySeq[seq];
+    }
+
+    //! Get dense event index by type id sequence number, -1 if no handlers
+    int getEventIndex(unsigned int seq) const
+    {
+        if (seq >= eventIndexBySeq.size())
+            return -1;
+        return eventIndexBySeq[seq];
+    }
+
+    //! Get the up to date molds matching a Query template instance
+    std::shared_ptr<MoldQuery> getMoldQuery(asITypeInfo* queryType);
+
+    //! Match the molds created since the query was last updated
+    void updateMoldQuery(MoldQuery* q);
+
+    //! array<Entity@> type, looked up on first use
+    asITypeInfo* getEntityArrayType();
+
+    //! array<float> type, looked up on first use
+    asITypeInfo* getFloatArrayType();
+
     EntitySystem* getSystem();
     friend class EntitySystem;
     
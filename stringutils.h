@@ -23,7 +23,13 @@ static std::vector<std::string> SplitStringByComma(const char * str)
 
     auto addsec = [&]
     {
-        res.push_back(std::string(bg, str));
+        //ignore the whitespace around the items
+        const char* ed = str;
+        while (bg < ed && *bg == ' ')
+            bg++;
+        while (ed > bg && *(ed - 1) == ' ')
+            ed--;
+        res.push_back(std::string(bg, ed));
         bg = str + 1;
     };
 
@@ -49,3 +55,27 @@ static bool IsPresentInList(const std::vector<std::string>& haystack, const char
     }
     return false;
 }
+
+//Value of a "key=value" item, whitespace around the '=' is ignored
+static bool GetValueFromList(const std::vector<std::string>& haystack, const char * key, std::string& value)
+{
+    if (key == nullptr)
+        return false;
+    size_t keyLen = strlen(key);
+    for (const std::string& t : haystack)
+    {
+        if (t.compare(0, keyLen, key) != 0)
+            continue;
+        size_t pos = keyLen;
+        while (pos < t.size() && t[pos] == ' ')
+            pos++;
+        if (pos >= t.size() || t[pos] != '=')
+            continue;
+        pos++;
+        while (pos < t.size() && t[pos] == ' ')
+            pos++;
+        value = t.substr(pos);
+        return true;
+    }
+    return false;
+}
@@ -32,6 +32,7 @@
 #include <scriptbuilder/scriptbuilder.h>
 
 #include <cstring>
+#include <chrono>
 #include <fstream>
 #include <sstream>
 #include <iostream>
@@ -106,6 +107,22 @@ void exceptionCallback(asIScriptContext *ctx, void*)
 
 
 
+//Microseconds from an arbitrary start, for timing parts of a benchmark
+double benchmarkTime()
+{
+    auto t = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration<double, std::micro>(t).count();
+}
+
+//Print the cost of a single operation of a benchmark
+void reportBenchmark(const std::string& name, double microseconds, unsigned int operations)
+{
+    std::cout << "BENCH \"" << name << "\" " << microseconds / (operations ? operations : 1)
+              << " us per op (" << operations << " ops, " << microseconds << " us)" << std::endl;
+}
+
+
+
 //Contains all the logic required to get the GHMAS extensions to work
 class GHMASScriptInterface : public AngelScriptInterface
 {
@@ -136,6 +153,9 @@ public:
         RegisterScriptAny(engine);
         RegisterRandom(engine);
 
+        engine->RegisterGlobalFunction("double BenchmarkTime()", asFUNCTION(benchmarkTime), asCALL_CDECL);
+        engine->RegisterGlobalFunction("void ReportBenchmark(const string &in, double, uint)", asFUNCTION(reportBenchmark), asCALL_CDECL);
+
         RegisterCoroutine(engine, &crstack);
         RegisterThread(engine);
 
@@ -169,6 +189,8 @@ public:
         esm.getSystem()->clear();
         //Rebuild entity class tables
         esm.getSystem()->preallocate();
+        //Tests wanting the worker pool start it themselves
+        esm.getSystem()->setWorkerThreads(0);
         return AngelUnit::RunTest(results, func, context, nullptr, &crstack);
     }
 
@@ -203,7 +225,7 @@ int main(int argc, const char** argv)
         std::cerr << "[--junit XML_OUTPUT] ";
         #endif
 
-        std::cerr << "INPUTS ...";
+        std::cerr << "[--bench] INPUTS ...";
         std::cerr << std::endl;
         return 1;
     };
@@ -214,10 +236,20 @@ int main(int argc, const char** argv)
 
     std::vector<const char*> inputFiles;
 
+    //Run the [Benchmark] functions instead of the [Test] functions
+    bool benchmarks = false;
+
     argc--; argv++;
     
     while (argc)
     {
+        if (std::strcmp(*argv, "--bench") == 0)
+        {
+            benchmarks = true;
+            argc--; argv++;
+            continue;
+        }
+
         #ifdef ANGELUNIT_XML_OUTPUT
         if (std::strcmp(*argv, "--junit") == 0)
         {
@@ -405,10 +437,10 @@ int main(int argc, const char** argv)
     {
         auto* func = builder.GetModule()->GetFunctionByIndex(a);
 
-        //Check if we got a [Test]
+        //Check if we got a [Test], or a [Benchmark] when benchmarking
         if (std::strcmp(
             builder.GetMetadataStringForFunc(func),
-            "Test") != 0)
+            benchmarks ? "Benchmark" : "Test") != 0)
             continue;
 
         std::string testName;
@@ -450,7 +482,7 @@ int main(int argc, const char** argv)
             fails += 1;
         }
 
-        std::cout << "\"" << suiteName << "::" << testName << "\"" << std::endl;
+        std::cout << "\"" << suiteName << "::" << testName << "\" (" << tr.runTime << " us)" << std::endl;
         i+= 1;
 
 